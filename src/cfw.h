@@ -2,7 +2,13 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 #include <array>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
 
 #define CFW_NS_BEGIN namespace cfw {
 #define CFW_NS_END }
@@ -18,7 +24,36 @@ enum class Cmd : uint8_t
 {
 	kConn = 1,
 	kData = 2,
-	kClose = 3
+	kClose = 3,
+	// key 0, echoed by the server with its queue depth appended
+	kProbe = 4,
+	// datagram of a UDP association: ATYP ADDR PORT DATA, the SOCKS UDP
+	// header without RSV FRAG; the first one opens the association
+	kUdp = 5
+};
+
+// high bits of the cmd byte on the wire
+const uint8_t kPkgFlagLz = 0x80;	// data is LZ compressed
+const uint8_t kPkgFlagMask = 0xf0;
+
+struct PkgTrace;
+class StreamAccount;
+
+// bytes of a pkg held against the memory budget (see cfw_budget.h),
+// given back when the pkg goes away
+struct BudgetCharge
+{
+	BudgetCharge() = default;
+	BudgetCharge(const BudgetCharge&) = delete;
+	BudgetCharge& operator=(const BudgetCharge&) = delete;
+	~BudgetCharge() {
+		if (bytes)
+			Release();
+	}
+	void Release();
+
+	std::shared_ptr<StreamAccount> account;
+	size_t bytes = 0;
 };
 
 struct Pkg 
@@ -30,7 +65,11 @@ struct Pkg
 
 	Key key;
 	Cmd cmd;
+	uint8_t flags = 0;
 	Bytes data;
+	// stage timestamps, only set when tracing (see cfw_trace.h)
+	std::shared_ptr<PkgTrace> trace;
+	BudgetCharge charge;
 };
 
 #if 0
@@ -48,9 +87,94 @@ class SockAddrIn;
 class TcpSocket;
 class Crypt;
 
+// key(8) cmd|flags(1) data_len(4)
+const size_t kPkgHeadLen = 13;
+// largest datagram relayed, a kUdp pkg also carries its address
+const size_t kMaxDatagram = sizeof(PkgBuffer) - kPkgHeadLen - 10;
+// A direct connection carries one stream in plaintext: this magic,
+// ATYP DST.ADDR DST.PORT as in SOCKS5, then the stream bytes both ways
+const uint8_t kDirectMagic[4] = {'C', 'F', 'W', 'D'};
+
 uint64_t MakeKey(const SockAddrIn& addr);
+// for peers without an inet address (UNIX sockets)
+uint64_t MakeKey();
+bool ResolveIp(const char* url, uint32_t* net_order_ip);
 bool SendPkg(TcpSocket& sk, Crypt& crypt, const Pkg& pkg);
-//ret 0:ok 1:timeout -1:error
-int RecvPkg(TcpSocket& sk, Crypt& crypt, Pkg* pkg, std::chrono::milliseconds msecs);
+// encode all pkgs into one buffer, appended to *out
+void EncodePkgs(Crypt& crypt, const std::vector<std::shared_ptr<Pkg>>& pkgs, Bytes* out);
+
+// The byte stream a tunnel runs on: a TcpSocket, or an in-memory link
+// in the simulator (see cfw_memlink.h)
+class Transport
+{
+public:
+	virtual ~Transport() = default;
+	// append at most max bytes to *out, waiting at most msecs
+	// ret >0:bytes 0:closed -1:error (errno EAGAIN on timeout)
+	virtual int RecvSome(Bytes* out, size_t max, std::chrono::milliseconds msecs) = 0;
+	// non-blocking write of what the transport takes now
+	// ret bytes taken, -1 on error (errno EAGAIN when it takes none)
+	virtual int SendSome(const iovec* iov, int cnt) = 0;
+	// wait at most msecs for POLLIN and/or POLLOUT as poll(2) does
+	// ret >0:events 0:timeout -1:error
+	virtual int Poll(short events, std::chrono::milliseconds msecs) = 0;
+	// read or write exactly n bytes, waiting at most msecs each time
+	// nothing moves; ret false on error, EOF or timeout
+	bool ReadN(uint8_t* buf, size_t n, std::chrono::milliseconds msecs);
+	bool WriteN(const uint8_t* buf, size_t n, std::chrono::milliseconds msecs);
+	template <class T>
+	bool ReadValue(T* v, std::chrono::milliseconds msecs) {
+		return ReadN(reinterpret_cast<uint8_t*>(v), sizeof(T), msecs);
+	}
+};
+
+// Bytes for a socket we must not block on, written with non-blocking
+// sendmsg() as far as the socket takes them. A pkg given along is kept
+// (with its budget charge and trace) until its data is out.
+class OutBuffer
+{
+public:
+	void Append(Bytes data, std::shared_ptr<Pkg> pkg = {});
+	// write what the socket takes now, *done gets the pkgs whose data
+	// went out; ret false on error
+	bool Flush(Transport& sk, std::vector<std::shared_ptr<Pkg>>* done = nullptr);
+	size_t size() const {
+		return size_;
+	}
+	bool empty() const {
+		return size_ == 0;
+	}
+private:
+	struct Chunk {
+		Bytes data;
+		std::shared_ptr<Pkg> pkg;
+	};
+	std::deque<Chunk> chunks_;
+	size_t offset_ = 0;	// into the first chunk
+	size_t size_ = 0;
+};
+// take no more pkgs for an OutBuffer holding this much, they wait in
+// the channel where the memory budget sees them
+const size_t kOutBufferLimit = 1 << 20;
+
+// Reads pkgs from the tunnel in large chunks and splits them locally,
+// Crypt is a byte stream so whole chunks can be decrypted on arrival
+class PkgReader
+{
+public:
+	PkgReader(Transport& sk, Crypt& crypt) : sk_(sk), crypt_(crypt) {}
+	PkgReader(const PkgReader&) = delete;
+	PkgReader& operator=(const PkgReader&) = delete;
+	//ret 0:ok 1:timeout -1:error
+	int Read(Pkg* pkg, std::chrono::milliseconds msecs);
+private:
+	bool Parse(Pkg* pkg);
+private:
+	Transport& sk_;
+	Crypt& crypt_;
+	Bytes buf_;
+	size_t pos_ = 0;
+	bool bad_ = false;
+};
 
 CFW_NS_END
@@ -0,0 +1,254 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <map>
+#include <mutex>
+#include <new>
+#include <glog/logging.h>
+#include "cfw_budget.h"
+#include "cfw_clock.h"
+
+CFW_NS_BEGIN
+
+// processes that can hold streams at once, the server forks one per tunnel
+static const size_t kSlots = 1024;
+// a free slot, or one being reaped
+static const pid_t kFree = 0;
+static const pid_t kReaping = -1;
+
+namespace {
+
+// what one process holds, taken back from the totals once it is dead
+struct BudgetSlot
+{
+	std::atomic<pid_t> pid{kFree};
+	std::atomic<uint64_t> bytes{0};
+	std::atomic<uint64_t> streams{0};
+};
+
+// mapped shared before the tunnel processes fork, so the limits are
+// server wide
+struct BudgetShared
+{
+	std::atomic<uint64_t> bytes{0};
+	std::atomic<uint64_t> streams{0};
+	std::atomic<uint64_t> refused{0};
+	std::atomic<uint64_t> paused{0};
+	BudgetSlot slots[kSlots];
+};
+
+} // namespace
+
+static bool g_on = false;
+static uint64_t g_max_bytes = 0;
+static uint64_t g_max_streams = 0;
+// until Configure() maps the shared one
+static BudgetShared g_local;
+static BudgetShared* g_shared = &g_local;
+// of this process, a forked child takes its own
+static std::atomic<BudgetSlot*> g_slot{nullptr};
+static std::mutex g_slot_mutex;
+static std::atomic<time_t> g_last_reap{0};
+// accounts by stream key, for pkgs coming in from the tunnel
+static std::mutex g_mutex;
+static std::map<Key, std::weak_ptr<StreamAccount>> g_accounts;
+
+static void ForgetSlotInChild()
+{
+	g_slot.store(nullptr, std::memory_order_relaxed);
+}
+
+// give back what the dead processes held, at most once a second
+static void Reap()
+{
+	time_t now = Clock::Time();
+	time_t last = g_last_reap.load(std::memory_order_relaxed);
+	if (last == now || !g_last_reap.compare_exchange_strong(last, now))
+		return;
+	for (BudgetSlot& s : g_shared->slots) {
+		pid_t pid = s.pid.load(std::memory_order_acquire);
+		if (pid == kFree || pid == kReaping || ::kill(pid, 0) == 0 || errno != ESRCH)
+			continue;
+		if (!s.pid.compare_exchange_strong(pid, kReaping))
+			continue;
+		g_shared->bytes.fetch_sub(s.bytes.exchange(0), std::memory_order_relaxed);
+		g_shared->streams.fetch_sub(s.streams.exchange(0), std::memory_order_relaxed);
+		s.pid.store(kFree, std::memory_order_release);
+	}
+}
+
+static BudgetSlot* OwnSlot()
+{
+	BudgetSlot* slot = g_slot.load(std::memory_order_acquire);
+	if (slot)
+		return slot;
+	static std::once_flag atfork_once;
+	std::call_once(atfork_once, [] {
+		::pthread_atfork(nullptr, nullptr, ForgetSlotInChild);
+	});
+	std::lock_guard<std::mutex> lock(g_slot_mutex);
+	if ((slot = g_slot.load(std::memory_order_relaxed)))
+		return slot;
+	for (BudgetSlot& s : g_shared->slots) {
+		pid_t pid = kFree;
+		if (s.pid.compare_exchange_strong(pid, ::getpid())) {
+			slot = &s;
+			break;
+		}
+	}
+	if (!slot) {
+		LOG(ERROR) << "budget: no slot left, the streams of pid " << ::getpid()
+			<< " are never given back when it dies";
+		static BudgetSlot overflow;
+		slot = &overflow;
+	}
+	g_slot.store(slot, std::memory_order_release);
+	return slot;
+}
+
+static void AddStreams(uint64_t n)
+{
+	OwnSlot()->streams.fetch_add(n, std::memory_order_relaxed);
+}
+
+static void SubStreams(uint64_t n)
+{
+	g_shared->streams.fetch_sub(n, std::memory_order_relaxed);
+	OwnSlot()->streams.fetch_sub(n, std::memory_order_relaxed);
+}
+
+static void AddBytes(uint64_t n)
+{
+	g_shared->bytes.fetch_add(n, std::memory_order_relaxed);
+	OwnSlot()->bytes.fetch_add(n, std::memory_order_relaxed);
+}
+
+static void SubBytes(uint64_t n)
+{
+	g_shared->bytes.fetch_sub(n, std::memory_order_relaxed);
+	OwnSlot()->bytes.fetch_sub(n, std::memory_order_relaxed);
+}
+
+StreamAccount::~StreamAccount()
+{
+	SubStreams(1);
+	if (registered_) {
+		std::lock_guard<std::mutex> lock(g_mutex);
+		auto it = g_accounts.find(key_);
+		// unless the key was admitted again meanwhile
+		if (it != g_accounts.end() && it->second.expired())
+			g_accounts.erase(it);
+	}
+}
+
+void BudgetCharge::Release()
+{
+	SubBytes(bytes);
+	if (account)
+		account->bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+	bytes = 0;
+	account.reset();
+}
+
+void Budget::Configure(uint64_t max_bytes, uint64_t max_streams)
+{
+	g_max_bytes = max_bytes;
+	g_max_streams = max_streams;
+	g_on = (max_bytes || max_streams);
+	if (g_on && g_shared == &g_local) {
+		void* p = ::mmap(nullptr, sizeof(BudgetShared), PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		PCHECK(p != MAP_FAILED) << "mmap budget";
+		g_shared = new (p) BudgetShared;
+	}
+}
+
+std::shared_ptr<StreamAccount> Budget::Admit(Key key)
+{
+	if (g_on)
+		Reap();
+	// check and count in one step, so racing streams can't overshoot
+	uint64_t streams = g_shared->streams.load(std::memory_order_relaxed);
+	do {
+		if ((g_max_streams && streams >= g_max_streams) ||
+				(g_max_bytes && g_shared->bytes.load(std::memory_order_relaxed) >= g_max_bytes)) {
+			++g_shared->refused;
+			return {};
+		}
+	} while (!g_shared->streams.compare_exchange_weak(streams, streams + 1, std::memory_order_relaxed));
+	AddStreams(1);
+	auto acct = std::make_shared<StreamAccount>();
+	if (g_on) {
+		acct->key_ = key;
+		acct->registered_ = true;
+		std::lock_guard<std::mutex> lock(g_mutex);
+		g_accounts[key] = acct;
+	}
+	return acct;
+}
+
+void Budget::Charge(Pkg* pkg, const std::shared_ptr<StreamAccount>& acct)
+{
+	if (!g_on || pkg->data.empty())
+		return;
+	pkg->charge.Release();
+	pkg->charge.bytes = pkg->data.size();
+	pkg->charge.account = acct;
+	AddBytes(pkg->charge.bytes);
+	if (acct)
+		acct->bytes_.fetch_add(pkg->charge.bytes, std::memory_order_relaxed);
+}
+
+void Budget::ChargeStream(Pkg* pkg)
+{
+	if (!g_on || pkg->data.empty())
+		return;
+	std::shared_ptr<StreamAccount> acct;
+	{
+		std::lock_guard<std::mutex> lock(g_mutex);
+		auto it = g_accounts.find(pkg->key);
+		if (it != g_accounts.end())
+			acct = it->second.lock();
+	}
+	Charge(pkg, acct);
+}
+
+static bool Paused(const StreamAccount& acct)
+{
+	if (!g_max_bytes)
+		return false;
+	uint64_t total = g_shared->bytes.load(std::memory_order_relaxed);
+	if (total < g_max_bytes)
+		return false;
+	uint64_t streams = g_shared->streams.load(std::memory_order_relaxed);
+	// above the fair share, the heaviest streams back off first
+	return acct.bytes() * (streams ? streams : 1) > total;
+}
+
+bool Budget::ShouldPause(const StreamAccount& acct)
+{
+	bool paused = Paused(acct);
+	// count the pauses, not the checks while paused
+	if (paused && !acct.paused_)
+		++g_shared->paused;
+	acct.paused_ = paused;
+	return paused;
+}
+
+std::string Budget::StatsString()
+{
+	char str[160];
+	snprintf(str, sizeof(str), "budget streams:%llu/%llu bytes:%llu/%llu refused:%llu paused:%llu",
+			static_cast<unsigned long long>(g_shared->streams.load()),
+			static_cast<unsigned long long>(g_max_streams),
+			static_cast<unsigned long long>(g_shared->bytes.load()),
+			static_cast<unsigned long long>(g_max_bytes),
+			static_cast<unsigned long long>(g_shared->refused.load()),
+			static_cast<unsigned long long>(g_shared->paused.load()));
+	return str;
+}
+
+CFW_NS_END
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include "cfw.h"
+
+CFW_NS_BEGIN
+
+// Bytes a stream has queued in pkgs that are still alive
+class StreamAccount
+{
+public:
+	StreamAccount() = default;
+	StreamAccount(const StreamAccount&) = delete;
+	StreamAccount& operator=(const StreamAccount&) = delete;
+	~StreamAccount();
+	uint64_t bytes() const {
+		return bytes_.load(std::memory_order_relaxed);
+	}
+private:
+	friend class Budget;
+	friend struct BudgetCharge;
+	std::atomic<uint64_t> bytes_{0};
+	Key key_ = 0;
+	bool registered_ = false;
+	// by the last ShouldPause(), only the stream itself calls it
+	mutable bool paused_ = false;
+};
+
+// Limits on queued pkg bytes and live streams, shared with the processes
+// forked after Configure(); what a dead one held is given back. Over the
+// byte budget, new streams are refused and streams holding more than
+// their fair share of the queued bytes stop reading until it drains.
+class Budget
+{
+public:
+	// 0 means no limit, accounting is off unless a limit is set; call
+	// before forking the processes to share the limits with
+	static void Configure(uint64_t max_bytes, uint64_t max_streams);
+	// ret nullptr if the stream must be refused, the stream counts
+	// until the account and every pkg charged to it are gone
+	static std::shared_ptr<StreamAccount> Admit(Key key);
+	// hold pkg->data against the budget (and acct if set) for the
+	// lifetime of pkg
+	static void Charge(Pkg* pkg, const std::shared_ptr<StreamAccount>& acct);
+	// Charge() to the account admitted for pkg->key, for pkgs read from
+	// the tunnel and queued for their stream
+	static void ChargeStream(Pkg* pkg);
+	// from the thread of the stream only
+	static bool ShouldPause(const StreamAccount& acct);
+	static std::string StatsString();
+};
+
+CFW_NS_END
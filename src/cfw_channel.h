@@ -8,6 +8,7 @@
 #include <utility>
 #include <glog/logging.h>
 #include "cfw.h"
+#include "cfw_clock.h"
 
 CFW_NS_BEGIN
 
@@ -21,7 +22,7 @@ public:
 			Touch();
 		}
 		void Touch() {
-			last_active = ::time(nullptr);
+			last_active = Clock::Time();
 		}
 		std::queue<std::shared_ptr<T>> queue;
 		std::mutex mutex;
@@ -33,9 +34,11 @@ public:
 	void Push(Key k, std::shared_ptr<T>&& v);
 	bool Own(Key k);
 	void Free(Key k);
+	size_t Size(Key k);
 	void GarbageCleanup(time_t secs);
 private:
-	std::shared_ptr<Queue> GetQueue(Key k, bool create);
+	// touch to keep the queue from GarbageCleanup(), unless only looking
+	std::shared_ptr<Queue> GetQueue(Key k, bool create, bool touch = true);
 private:
 	std::map<Key, std::shared_ptr<Queue>> map_;
 	std::mutex map_mutex_;
@@ -52,7 +55,7 @@ struct PopHelper
 };
 
 template <class T>
-std::shared_ptr<typename Channel<T>::Queue> Channel<T>::GetQueue(Key k, bool create)
+std::shared_ptr<typename Channel<T>::Queue> Channel<T>::GetQueue(Key k, bool create, bool touch)
 {
 	std::lock_guard<std::mutex> lock(map_mutex_);
 	auto it = map_.find(k);
@@ -63,7 +66,8 @@ std::shared_ptr<typename Channel<T>::Queue> Channel<T>::GetQueue(Key k, bool cre
 			return {};
 		}
 	} else {
-		it->second->Touch();
+		if (touch)
+			it->second->Touch();
 		return it->second;
 	}
 }
@@ -72,7 +76,7 @@ template <class T>
 void Channel<T>::GarbageCleanup(time_t secs)
 {
 	std::lock_guard<std::mutex> lock(map_mutex_);
-	time_t now = ::time(nullptr);
+	time_t now = Clock::Time();
 	std::vector<Key> gc_key_list;
 	for (auto& it : map_) {
 		if (it.second->last_active + secs < now) {
@@ -123,6 +127,16 @@ bool Channel<T>::Own(Key k)
 	return q->own.try_lock();
 }
 
+template <class T>
+size_t Channel<T>::Size(Key k)
+{
+	auto q = GetQueue(k, false, false);
+	if (!q)
+		return 0;
+	std::lock_guard<std::mutex> lock(q->mutex);
+	return q->queue.size();
+}
+
 template <class T>
 void Channel<T>::Free(Key k)
 {
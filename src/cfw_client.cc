@@ -1,139 +1,151 @@
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <atomic>
+#include <cstring>
+#include <memory>
 #include <string>
+#include <vector>
 #include <thread>
 #include <queue>
 #include <array>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include "socket.h"
+#include "io_engine.h"
 #include "cfw_channel.h"
-#include "cfw_crypt.h"
+#include "cfw_compress.h"
+#include "cfw_trace.h"
+#include "cfw_budget.h"
+#include "cfw_record.h"
+#include "cfw_handoff.h"
+#include "cfw_client_io.h"
 
 using namespace cfw;
 
 DEFINE_uint64(port, 12321, "bind port");
 DEFINE_string(server, "127.0.0.1", "server IP");
 DEFINE_uint64(server_port, 12322, "server port");
+DEFINE_string(servers, "", "ip:port,... keep tunnels to all of them and place each new stream on"
+		" the one with the best probed RTT and queue depth, overrides --server");
+DEFINE_uint64(probe_ms, 1000, "probe interval of each tunnel");
+DEFINE_uint64(tunnel_timeout_ms, 5000, "reconnect a tunnel nothing arrived on for this long,"
+		" at least a probe interval plus the RTT and 4 jitters");
+DEFINE_string(listen_unix, "", "listen on this UNIX socket path instead of --port, '@' for abstract");
+DEFINE_string(server_unix, "", "connect the tunnel to this UNIX socket instead of --server");
+DEFINE_bool(socks_local, false, "answer SOCKS5 locally and send CONNECT with early data in kConn");
+DEFINE_uint64(early_data_ms, 5, "wait for early data before sending kConn with --socks_local");
+DEFINE_uint64(direct_port, 0, "give each stream its own plaintext connection to this server port,"
+		" relayed with splice(), for trusted links; SOCKS is answered locally, 0 to multiplex");
+DEFINE_bool(compress, false, "compress data sent over the tunnel when it pays off");
+DEFINE_bool(io_uring, false, "use io_uring for socket I/O if the kernel supports it");
+DEFINE_uint64(workers, 1, "workers, each with its own SO_REUSEPORT listener, tunnel and core");
+DEFINE_string(record_file, "", "append the frames crossing the tunnel to this trace file");
+DEFINE_bool(record_payload, false, "record frame payloads too, not only their length");
+DEFINE_bool(trace, false, "trace pkgs through the pipeline stages and log latency histograms");
+DEFINE_string(trace_file, "", "ring file for sampled pkg traces with --trace");
+DEFINE_uint64(trace_sample, 1024, "dump 1 of this many pkg traces to --trace_file");
+DEFINE_uint64(mem_budget_mb, 0, "refuse new streams and pause the heaviest ones when queued pkgs"
+		" hold more than this, 0 for no limit");
+DEFINE_uint64(max_streams, 0, "refuse new streams beyond this many, 0 for no limit");
+DEFINE_string(listen_sockopts, "default", "local listener socket profile: default|latency|throughput");
+DEFINE_string(handoff_path, "", "UNIX socket to take the listeners of a running client from and to"
+		" hand them to the next one on, for restarts without refused connections");
+DEFINE_uint64(drain_secs, 600, "after handing off the listeners, exit once the streams are done"
+		" or after this long");
+DEFINE_string(tunnel_sockopts, "default", "tunnel socket profile: default|latency|throughput,"
+		" fast open needs net.ipv4.tcp_fastopen on both hosts");
 
-static Channel<Pkg> g_channel;
+static ClientOptions g_opts;
+static SockOpts g_listen_opts;
+// what a handed off client waits for before it exits
+static std::atomic<unsigned> g_accept_loops{0};
+static std::atomic<unsigned> g_clients{0};
 
-void HandleClient(TcpSocket csk)
+void ChannelIoThread(Worker* w, Tunnel* t)
 {
-	SockAddrIn client_addr;
-	csk.GetPeerAddr(&client_addr);
-	auto key = MakeKey(client_addr);
-	VLOG(1) << "MakeKey: " << key;
-	if (!g_channel.Own(key)) {
-		LOG(FATAL) << "thread:" << key << " client key conflicts";
-	}
-	g_channel.Push(0, std::make_shared<Pkg>(key, Cmd::kConn));
-	LOG(INFO) << "thread:" << key << " start";
-
-	Buffer buf;
-	time_t last_active = ::time(nullptr);
-	// wait 50ms for data incoming, CAN'T use RecvN
-	PCHECK(csk.SetRecvTimeout(std::chrono::milliseconds(50)));
+	LOG(INFO) << "io thread start, worker:" << w->id << " tunnel:" << t->host << ":" << t->port;
 	while (true) {
-		int len = csk.Recv(buf.data(), sizeof(buf));
-		if (len > 0) {
-			LOG(INFO) << "thread:" << key << " socket recv tcp pkg [" << len << "]";
-			g_channel.Push(0, std::make_shared<Pkg>(key, Cmd::kData, buf.data(), len));
-			last_active = ::time(nullptr);
-		} else if (len < 0 && errno == EAGAIN) {
-			VLOG(1) << "thread:" << key << " socket recv timeout";
+		std::unique_ptr<TcpSocket> sk;
+		bool connected;
+		if (FLAGS_server_unix.empty()) {
+			sk.reset(new TcpSocket);
+			PLOG_IF(WARNING, !sk->SetOpts(g_opts.tunnel_opts)) << "io thread set tunnel sockopts";
+			connected = sk->Connect(SockAddrIn(t->host, t->port));
 		} else {
-			if (len == 0) {
-				LOG(INFO) << "thread:" << key << " socket closed by peer";
-			} else {
-				PLOG(INFO) << "thread:" << key << " socket recv error";
-			}
-			g_channel.Push(0, std::make_shared<Pkg>(key, Cmd::kClose));
-			goto exit;
-		}
-
-		while (true) {
-			auto pkg = g_channel.Pop(key);
-			if (!pkg) {
-				VLOG(1) << "thread:" << key << " channel empty";
-				break; // go on reading socket
-			}
-			last_active = ::time(nullptr);
-			if (pkg->cmd == Cmd::kClose) {
-				LOG(INFO) << "thread:" << key << " channel cmd kClose";
-				goto exit;
-			} else if (pkg->cmd == Cmd::kData) {
-				LOG(INFO) << "thread:" << key << " channel cmd kData";
-				if(!csk.SendValue(pkg->data)) {
-					PLOG(ERROR) << "thread:" << key << " socket send data error";
-					g_channel.Push(0, std::make_shared<Pkg>(key, Cmd::kClose));
-					goto exit;
-				}
-			} else {
-				LOG(FATAL) << "thread:" << key << " channel cmd unexpected";
-			}
+			sk.reset(new UnixSocket);
+			connected = sk->Connect(SockAddrUn(FLAGS_server_unix));
 		}
-
-		if (last_active + 600 < ::time(nullptr)) {
-			LOG(ERROR) << "thread:" << key << " is dead";
-			goto exit;
+		if (connected) {
+			LOG(INFO) << "io thread connected to server";
+			RunTunnel(w, t, *sk);
+			LOG(INFO) << "io thread disconnected to server";
+		} else {
+			LOG(INFO) << "io thread connect server failed";
 		}
+		std::this_thread::sleep_for(std::chrono::seconds(1));
 	}
-exit:
-	g_channel.Free(key);
-	LOG(INFO) << "thread:" << key << " exit";
 }
 
-void ProcessIo(TcpSocket& sk)
+static void PinToCpu(unsigned cpu)
 {
-	Crypt enc, dec;
-	// wait 10min for expected data
-	sk.SetRecvTimeout(std::chrono::minutes(10));
-	while (true) {
-		auto new_pkg = std::make_shared<Pkg>();
-		// wait 50ms for pkg incoming
-		int r = RecvPkg(sk, dec, new_pkg.get(), std::chrono::milliseconds(50));
-		if (r < 0) {
-			PLOG(INFO) << "io socket recv error";
-			break;
-		} else if (r == 0) {
-			LOG(INFO) << "io socket recv pkg {key:" << new_pkg->key 
-				<< " cmd:" << static_cast<unsigned>(new_pkg->cmd)
-				<< " len:" << new_pkg->data.size() << "}";
-			g_channel.Push(new_pkg->key, new_pkg);
-		} else {
-			VLOG(1) << "io socket recv timeout";
-		}
-
-		while (true) {
-			auto pkg = g_channel.Pop(0);
-			if (!pkg) {
-				VLOG(1) << "io channel empty";
-			   	break;
-			}
-			LOG(INFO) << "io channel recv pkg {key:" << pkg->key
-				<< " cmd:" << static_cast<unsigned>(pkg->cmd)
-				<< " len:" << pkg->data.size() << "}";
-			bool ret = SendPkg(sk, enc, *pkg);
-			PLOG_IF(ERROR, !ret) << "io socket send pkg error";
-		}
-	}
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	int r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	LOG_IF(WARNING, r != 0) << "pin to cpu:" << cpu << " failed, error:" << r;
 }
 
-void ChannelIoThread()
+// one per worker, or one shared by all when listening on a UNIX
+// socket, which has no SO_REUSEPORT balancing
+static std::vector<std::unique_ptr<TcpServerSocket>> g_listeners;
+
+// accept loop of one worker, its io thread and stream threads inherit
+// the cpu affinity set here
+void WorkerLoop(Worker* w)
 {
-	LOG(INFO) << "io thread start";
-	while (true) {
-		TcpSocket sk;
-		if (sk.Connect(SockAddrIn(FLAGS_server, FLAGS_server_port))) {
-			LOG(INFO) << "io thread connected to server";
-			ProcessIo(sk);
-			// connection loss
-			// g_channel.Broadcast(0, std::make_share<Pkg>(Cmd::kClose));
-			LOG(INFO) << "io thread disconnected to server";
-		} else {
-			LOG(INFO) << "io thread connect server failed";
+	if (FLAGS_workers > 1) {
+		unsigned ncpu = std::thread::hardware_concurrency();
+		PinToCpu(w->id % (ncpu ? ncpu : 1));
+	}
+	for (auto& t : w->tunnels)
+		std::thread(ChannelIoThread, w, t.get()).detach();
+
+	time_t last_gc = ::time(nullptr);
+	TcpServerSocket* ssk = w->listener;
+	// with a handoff the listener may go to a new process any time
+	bool handoff = !FLAGS_handoff_path.empty();
+	while (!Handoff::draining()) {
+		TcpSocket csk = (handoff ? ssk->TryAccept(std::chrono::seconds(1)) : ssk->Accept());
+		if (!csk && handoff && errno == EAGAIN)
+			continue;
+		PCHECK(csk) << "accept error";
+		LOG(INFO) << "accept new connection, worker:" << w->id;
+		// counted from the accept on
+		++g_clients;
+		std::thread([w](TcpSocket sk) {
+			HandleClient(w, std::move(sk));
+			--g_clients;
+		}, std::move(csk)).detach();
+
+		time_t now = ::time(nullptr);
+		if (last_gc + 60 < now) {
+			w->channel.GarbageCleanup(120);
+			for (auto& t : w->tunnels) {
+				LOG(INFO) << "worker:" << w->id << " tunnel:" << t->host << ":" << t->port
+					<< " up:" << t->up << " srtt:" << t->srtt_us << "us jitter:" << t->jitter_us
+					<< "us depth:" << t->depth;
+			}
+			if (w->id == 0) {
+				LOG(INFO) << IoEngine::StatsString();
+				LOG(INFO) << Compressor::StatsString();
+				LOG(INFO) << Tracer::StatsString();
+				LOG(INFO) << Budget::StatsString();
+			}
+			last_gc = now;
 		}
-		std::this_thread::sleep_for(std::chrono::seconds(1));
 	}
+	--g_accept_loops;
 }
 
 int main(int argc, char* argv[])
@@ -141,24 +153,88 @@ int main(int argc, char* argv[])
 	google::ParseCommandLineFlags(&argc, &argv, true);
 	google::InitGoogleLogging(argv[0]);
 	FLAGS_logbufsecs = 0;
+	IoEngine::UseUring(FLAGS_io_uring);
+	CHECK(SockOpts::Profile(FLAGS_listen_sockopts, &g_listen_opts))
+		<< "bad --listen_sockopts:" << FLAGS_listen_sockopts;
+	CHECK(SockOpts::Profile(FLAGS_tunnel_sockopts, &g_opts.tunnel_opts))
+		<< "bad --tunnel_sockopts:" << FLAGS_tunnel_sockopts;
+	CHECK(FLAGS_workers >= 1) << "bad --workers:" << FLAGS_workers;
+	CHECK(!FLAGS_direct_port || FLAGS_server_unix.empty()) << "--direct_port needs a TCP server";
+	g_opts.socks_local = FLAGS_socks_local;
+	g_opts.early_data = std::chrono::milliseconds(FLAGS_early_data_ms);
+	g_opts.direct_port = static_cast<uint16_t>(FLAGS_direct_port);
+	g_opts.unix_listener = !FLAGS_listen_unix.empty();
+	g_opts.probe = std::chrono::milliseconds(FLAGS_probe_ms);
+	g_opts.tunnel_timeout = std::chrono::milliseconds(FLAGS_tunnel_timeout_ms);
+	Compressor::Enable(FLAGS_compress);
+	Budget::Configure(FLAGS_mem_budget_mb << 20, FLAGS_max_streams);
+	if (!FLAGS_record_file.empty())
+		CHECK(FrameRecorder::Open(FLAGS_record_file, FLAGS_record_payload)) << "bad --record_file";
+	if (FLAGS_trace)
+		CHECK(Tracer::Enable(FLAGS_trace_file, FLAGS_trace_sample)) << "bad --trace_file";
+
+	// take the listeners over from a running client, before daemon()
+	// so a failure shows on the terminal
+	size_t nlisteners = (FLAGS_listen_unix.empty() ? FLAGS_workers : 1);
+	std::vector<int> fds;
+	if (!FLAGS_handoff_path.empty() && Handoff::Take(FLAGS_handoff_path, &fds)) {
+		CHECK_EQ(fds.size(), nlisteners) << "listeners taken over, keep --workers and --listen_unix";
+		for (int fd : fds)
+			g_listeners.emplace_back(new TcpServerSocket(fd));
+	} else if (!FLAGS_listen_unix.empty()) {
+		g_listeners.emplace_back(new UnixServerSocket(SockAddrUn(FLAGS_listen_unix)));
+		PCHECK(g_listeners.back()->Listen()) << "listen " << FLAGS_listen_unix;
+	} else {
+		for (size_t i = 0; i < nlisteners; ++i) {
+			g_listeners.emplace_back(new TcpServerSocket(SockAddrIn(FLAGS_port), FLAGS_workers > 1));
+			PLOG_IF(WARNING, !g_listeners.back()->SetOpts(g_listen_opts)) << "set listener sockopts";
+			PCHECK(g_listeners.back()->Listen()) << "listen " << FLAGS_port;
+		}
+	}
 	daemon(1, 1);
 	LOG(INFO) << "--- cfw_client start ---";
+	if (!FLAGS_handoff_path.empty()) {
+		fds.clear();
+		for (auto& l : g_listeners) {
+			// shared with the process on the other end of the handoff,
+			// accept must not block when that one took the connection
+			PCHECK(l->SetNonBlocking()) << "set listener non-blocking";
+			fds.push_back(l->sock());
+		}
+		Handoff::Serve(FLAGS_handoff_path, fds);
+	}
 
-	std::thread(ChannelIoThread).detach();
-
-	time_t last_gc = ::time(nullptr);
-	TcpServerSocket ssk{SockAddrIn(FLAGS_port)};
-	ssk.Listen();
-	while (true) {
-		TcpSocket csk = ssk.Accept();
-		PCHECK(csk) << "accept error";
-		LOG(INFO) << "accept new connection";
-		std::thread(HandleClient, std::move(csk)).detach();
+	std::vector<std::pair<std::string, uint16_t>> servers;
+	std::string list = FLAGS_servers;
+	while (!list.empty()) {
+		size_t end = list.find(',');
+		std::string item = list.substr(0, end);
+		list = (end == std::string::npos ? "" : list.substr(end + 1));
+		size_t colon = item.rfind(':');
+		CHECK(colon != std::string::npos) << "bad --servers item:" << item;
+		servers.emplace_back(item.substr(0, colon), std::stoi(item.substr(colon + 1)));
+	}
+	if (servers.empty())
+		servers.emplace_back(FLAGS_server, FLAGS_server_port);
 
-		time_t now = ::time(nullptr);
-		if (last_gc + 60 < now)
-			g_channel.GarbageCleanup(120);
+	std::vector<std::unique_ptr<Worker>> workers;
+	for (unsigned i = 0; i < FLAGS_workers; ++i) {
+		workers.emplace_back(new Worker(i, g_opts));
+		workers.back()->listener = g_listeners[i % g_listeners.size()].get();
+		for (auto& s : servers)
+			workers.back()->tunnels.emplace_back(new Tunnel(s.first, s.second));
 	}
+	g_accept_loops = workers.size();
+	for (size_t i = 1; i < workers.size(); ++i)
+		std::thread(WorkerLoop, workers[i].get()).detach();
+	WorkerLoop(workers[0].get());
 
-	return 0;
+	// handed off, wait for the other workers to stop accepting and
+	// for the clients to finish
+	time_t deadline = ::time(nullptr) + static_cast<time_t>(FLAGS_drain_secs);
+	while ((g_accept_loops > 0 || g_clients > 0) && ::time(nullptr) < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	LOG(INFO) << "drained, clients left:" << g_clients;
+	// detached stream and tunnel threads may still run
+	_exit(0);
 }
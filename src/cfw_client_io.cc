@@ -0,0 +1,499 @@
+#include <poll.h>
+#include <cstring>
+#include <glog/logging.h>
+#include "cfw_client_io.h"
+#include "cfw_clock.h"
+#include "cfw_crypt.h"
+#include "cfw_compress.h"
+#include "cfw_trace.h"
+#include "cfw_budget.h"
+#include "cfw_record.h"
+#include "cfw_pipe.h"
+
+CFW_NS_BEGIN
+
+// how long the SOCKS exchange may stall
+static const std::chrono::seconds kSocksWait(10);
+
+// Answer the SOCKS5 greeting and CONNECT locally, without waiting for
+// the server. conn_data gets ATYP DST.ADDR DST.PORT of the request and
+// then whatever the app sent right after our reply (early data).
+// Unless admitted, CONNECT is answered with a general failure.
+// With udp, UDP ASSOCIATE is accepted too: *udp gets the relay socket
+// the app was told to send its datagrams to, and nothing is read after.
+static bool ProcLocalSocks(Transport& csk, const ClientOptions& opts, Key key, Bytes* conn_data,
+		bool admitted = true, std::unique_ptr<UdpSocket>* udp = nullptr)
+{
+	uint8_t ver, meth_count;
+	Buffer buf;
+	if (!csk.ReadValue(&ver, kSocksWait) || !csk.ReadValue(&meth_count, kSocksWait) ||
+			!csk.ReadN(buf.data(), meth_count, kSocksWait))
+		return false;
+	if (ver != 5) {
+		LOG(ERROR) << "thread:" << key << " bad socks ver:" << static_cast<unsigned>(ver);
+		return false;
+	}
+	const uint8_t meth_rsp[2] = {5, 0};
+	if (!csk.WriteN(meth_rsp, sizeof(meth_rsp), kSocksWait))
+		return false;
+
+	uint8_t req[4]; // ver cmd rsv atyp
+	if (!csk.ReadN(req, sizeof(req), kSocksWait))
+		return false;
+	uint8_t rsp[10] = {5, 0, 0, 1, 0, 0, 0, 0, 0, 0};
+	bool associate = (req[1] == 3 && udp);
+	if (req[1] != 1 && !associate) {
+		LOG(ERROR) << "thread:" << key << " unsupported socks cmd:" << static_cast<unsigned>(req[1]);
+		rsp[1] = 7; // command not supported
+		csk.WriteN(rsp, sizeof(rsp), kSocksWait);
+		return false;
+	}
+	uint8_t atyp = req[3];
+	size_t addr_len;
+	conn_data->push_back(atyp);
+	if (atyp == 1) { // ip (v4)
+		addr_len = 4;
+	} else if (atyp == 3) { // url
+		uint8_t len;
+		if (!csk.ReadValue(&len, kSocksWait))
+			return false;
+		conn_data->push_back(len);
+		addr_len = len;
+	} else {
+		LOG(ERROR) << "thread:" << key << " unsupported socks atyp:" << static_cast<unsigned>(atyp);
+		rsp[1] = 8; // address type not supported
+		csk.WriteN(rsp, sizeof(rsp), kSocksWait);
+		return false;
+	}
+	if (!csk.ReadN(buf.data(), addr_len + 2, kSocksWait))
+		return false;
+	conn_data->append(buf.data(), addr_len + 2);
+	if (!admitted) {
+		rsp[1] = 1; // general SOCKS server failure
+		csk.WriteN(rsp, sizeof(rsp), kSocksWait);
+		return false;
+	}
+	if (associate) {
+		// DST is where the app will send from, not checked: the first
+		// datagram fixes the app address
+		SockAddrIn local(0x7f000001, 0);
+		TcpSocket* tcp = dynamic_cast<TcpSocket*>(&csk);
+		if (tcp && !opts.unix_listener)
+			tcp->GetSockAddr(&local);
+		std::unique_ptr<UdpSocket> usk(new UdpSocket);
+		SockAddrIn bnd;
+		if (!usk->Bind(SockAddrIn(local.ip(), 0)) || !usk->GetSockAddr(&bnd)) {
+			PLOG(ERROR) << "thread:" << key << " udp relay socket";
+			rsp[1] = 1; // general SOCKS server failure
+			csk.WriteN(rsp, sizeof(rsp), kSocksWait);
+			return false;
+		}
+		uint32_t ip = htonl(bnd.ip());
+		uint16_t port = htons(bnd.port());
+		std::memcpy(rsp + 4, &ip, sizeof(ip));
+		std::memcpy(rsp + 8, &port, sizeof(port));
+		if (!csk.WriteN(rsp, sizeof(rsp), kSocksWait))
+			return false;
+		LOG(INFO) << "thread:" << key << " local socks udp associate, relay:" << bnd.to_str();
+		*udp = std::move(usk);
+		return true;
+	}
+
+	// optimistic success, a failed upstream connect shows up as kClose
+	if (!csk.WriteN(rsp, sizeof(rsp), kSocksWait))
+		return false;
+	int r = csk.RecvSome(conn_data, sizeof(Buffer), opts.early_data);
+	if (r == 0 || (r < 0 && errno != EAGAIN))
+		return false;
+	LOG(INFO) << "thread:" << key << " local socks ok, kConn len:" << conn_data->size();
+	return true;
+}
+
+// Relay datagrams between the app and the tunnel until the app closes
+// the control connection. The association lives in the server from its
+// first kUdp to our kClose.
+static void ProcessUdpAssoc(Worker* w, Tunnel* t, uint32_t session, Key key,
+		TcpSocket& csk, UdpSocket& usk)
+{
+	std::vector<Datagram> in, out;
+	SockAddrIn app;
+	bool has_app = false;
+	time_t last_active = Clock::Time();
+	while (true) {
+		// app datagrams: RSV(2) FRAG(1) ATYP ADDR PORT DATA
+		int n = usk.RecvBatch(&in, kMaxDatagram, std::chrono::milliseconds(50));
+		if (n < 0 && errno != EAGAIN) {
+			PLOG(ERROR) << "thread:" << key << " udp recv error";
+			break;
+		}
+		for (int i = 0; i < n; ++i) {
+			Datagram& d = in[i];
+			if (has_app && (d.addr.ip() != app.ip() || d.addr.port() != app.port()))
+				continue;
+			// fragments are not supported, drop them as RFC 1928 allows
+			if (d.data.size() < 4 || d.data[2] != 0)
+				continue;
+			if (!has_app) {
+				app = d.addr;
+				has_app = true;
+			}
+			t->out.Push(0, std::make_shared<Pkg>(key, Cmd::kUdp,
+						d.data.data() + 3, d.data.size() - 3));
+			last_active = Clock::Time();
+		}
+
+		bool closed = false;
+		while (auto pkg = w->channel.Pop(key)) {
+			if (pkg->cmd == Cmd::kClose) {
+				closed = true;
+				break;
+			} else if (pkg->cmd == Cmd::kUdp && has_app) {
+				Datagram d;
+				d.addr = app;
+				d.data.assign(3, 0);
+				d.data.append(pkg->data);
+				out.push_back(std::move(d));
+			}
+		}
+		if (!out.empty()) {
+			usk.SendBatch(out);
+			out.clear();
+			last_active = Clock::Time();
+		}
+		if (closed) {
+			LOG(INFO) << "thread:" << key << " channel cmd kClose";
+			return;
+		}
+
+		// the association ends with the TCP connection that made it
+		uint8_t c;
+		int r = csk.Recv(&c, 1, MSG_DONTWAIT);
+		if (r == 0 || (r < 0 && errno != EAGAIN)) {
+			LOG(INFO) << "thread:" << key << " udp associate control closed";
+			break;
+		}
+		if (last_active + 600 < Clock::Time()) {
+			LOG(ERROR) << "thread:" << key << " is dead";
+			break;
+		}
+		if (!t->Alive(session)) {
+			LOG(ERROR) << "thread:" << key << " tunnel lost";
+			return;
+		}
+	}
+	t->out.Push(0, std::make_shared<Pkg>(key, Cmd::kClose));
+}
+
+// The stream gets a connection of its own to the server, in plaintext,
+// and both ends relay it with splice()
+static void ProcessDirect(const ClientOptions& opts, Key key, Tunnel* t, TcpSocket& csk)
+{
+	Bytes conn_data(kDirectMagic, sizeof(kDirectMagic));
+	if (!ProcLocalSocks(csk, opts, key, &conn_data)) {
+		LOG(ERROR) << "thread:" << key << " local socks handshake error";
+		return;
+	}
+	TcpSocket sk;
+	PLOG_IF(WARNING, !sk.SetOpts(opts.tunnel_opts)) << "thread:" << key << " set tunnel sockopts";
+	if (!sk.Connect(SockAddrIn(t->host, opts.direct_port)) ||
+			!sk.SendN(conn_data.data(), conn_data.size())) {
+		PLOG(ERROR) << "thread:" << key << " direct connect error";
+		return;
+	}
+	bool ok = TcpSocket::Splice(csk, sk, std::chrono::seconds(600));
+	PLOG_IF(INFO, !ok) << "thread:" << key << " direct relay error";
+}
+
+void HandleClient(Worker* w, TcpSocket csk)
+{
+	SockAddrIn client_addr;
+	Key key;
+	if (!w->opts.unix_listener) {
+		csk.GetPeerAddr(&client_addr);
+		key = MakeKey(client_addr);
+	} else {
+		key = MakeKey();
+	}
+	VLOG(1) << "MakeKey: " << key;
+	HandleStream(w, csk, key);
+}
+
+void HandleStream(Worker* w, Transport& csk, Key key)
+{
+	const ClientOptions& opts = w->opts;
+	if (!w->channel.Own(key)) {
+		LOG(FATAL) << "thread:" << key << " client key conflicts";
+	}
+	Tunnel* t = w->PickTunnel();
+	uint32_t session = t->session;
+	LOG(INFO) << "thread:" << key << " start, tunnel:" << t->host << ":" << t->port;
+	// UDP relays and splice() need a real socket
+	TcpSocket* tcp = dynamic_cast<TcpSocket*>(&csk);
+	auto acct = Budget::Admit(key);
+	if (!acct) {
+		// SOCKS is answered here whether or not --socks_local is set
+		LOG(WARNING) << "thread:" << key << " refused, over budget";
+		Bytes conn_data;
+		ProcLocalSocks(csk, opts, key, &conn_data, false);
+		w->channel.Free(key);
+		return;
+	}
+	if (opts.direct_port) {
+		CHECK(tcp) << "thread:" << key << " direct streams need a socket";
+		ProcessDirect(opts, key, t, *tcp);
+		w->channel.Free(key);
+		LOG(INFO) << "thread:" << key << " exit";
+		return;
+	}
+	if (opts.socks_local) {
+		Bytes conn_data;
+		std::unique_ptr<UdpSocket> usk;
+		if (!ProcLocalSocks(csk, opts, key, &conn_data, true, tcp ? &usk : nullptr)) {
+			LOG(ERROR) << "thread:" << key << " local socks handshake error";
+			w->channel.Free(key);
+			return;
+		}
+		if (usk) {
+			ProcessUdpAssoc(w, t, session, key, *tcp, *usk);
+			w->channel.Free(key);
+			LOG(INFO) << "thread:" << key << " exit";
+			return;
+		}
+		t->out.Push(0, std::make_shared<Pkg>(key, Cmd::kConn,
+					conn_data.data(), conn_data.size()));
+	} else {
+		t->out.Push(0, std::make_shared<Pkg>(key, Cmd::kConn));
+	}
+
+	Bytes in;
+	Compressor comp;
+	// what the app has not taken yet
+	OutBuffer out;
+	bool closed = false;
+	time_t last_active = Clock::Time();
+	while (true) {
+		int len;
+		in.clear();
+		if (closed) {
+			// the stream is over, wait for the app to take the rest
+			csk.Poll(POLLOUT, std::chrono::milliseconds(50));
+			len = -1;
+			errno = EAGAIN;
+		} else if (Budget::ShouldPause(*acct)) {
+			// leave the data in the socket buffer until the queues drain
+			Clock::SleepFor(std::chrono::milliseconds(50));
+			len = -1;
+			errno = EAGAIN;
+		} else if (!out.empty()) {
+			// the app is slow to read, wake up when it takes more too,
+			// read unless only POLLOUT came
+			if (csk.Poll(POLLIN | POLLOUT, std::chrono::milliseconds(50)) & ~POLLOUT) {
+				len = csk.RecvSome(&in, sizeof(Buffer), std::chrono::milliseconds(0));
+			} else {
+				len = -1;
+				errno = EAGAIN;
+			}
+		} else {
+			// wait 50ms for data incoming
+			len = csk.RecvSome(&in, sizeof(Buffer), std::chrono::milliseconds(50));
+		}
+		if (len > 0) {
+			LOG(INFO) << "thread:" << key << " socket recv tcp pkg [" << len << "]";
+			auto pkg = std::make_shared<Pkg>(key, Cmd::kData);
+			Tracer::Stamp(pkg.get(), kTraceRead);
+			comp.Pack(in.data(), len, pkg.get());
+			Budget::Charge(pkg.get(), acct);
+			Tracer::Stamp(pkg.get(), kTraceQueued);
+			t->out.Push(0, std::move(pkg));
+			last_active = Clock::Time();
+		} else if (len < 0 && errno == EAGAIN) {
+			VLOG(1) << "thread:" << key << " socket recv timeout";
+		} else {
+			if (len == 0) {
+				LOG(INFO) << "thread:" << key << " socket closed by peer";
+			} else {
+				PLOG(INFO) << "thread:" << key << " socket recv error";
+			}
+			t->out.Push(0, std::make_shared<Pkg>(key, Cmd::kClose));
+			goto exit;
+		}
+
+		// gather what is queued, what a slow app leaves stays in the channel
+		while (!closed && out.size() < kOutBufferLimit) {
+			auto pkg = w->channel.Pop(key);
+			if (!pkg) {
+				VLOG(1) << "thread:" << key << " channel empty";
+				break; // go on reading socket
+			}
+			last_active = Clock::Time();
+			if (pkg->cmd == Cmd::kClose) {
+				LOG(INFO) << "thread:" << key << " channel cmd kClose";
+				closed = true;
+			} else if (pkg->cmd == Cmd::kData) {
+				LOG(INFO) << "thread:" << key << " channel cmd kData";
+				Tracer::Stamp(pkg.get(), kTraceDelivered);
+				if (!Decompress(pkg.get())) {
+					t->out.Push(0, std::make_shared<Pkg>(key, Cmd::kClose));
+					goto exit;
+				}
+				Bytes data = std::move(pkg->data);
+				out.Append(std::move(data), std::move(pkg));
+			} else {
+				LOG(FATAL) << "thread:" << key << " channel cmd unexpected";
+			}
+		}
+		std::vector<std::shared_ptr<Pkg>> written;
+		if (!out.Flush(csk, &written)) {
+			PLOG(ERROR) << "thread:" << key << " socket send data error";
+			if (!closed)
+				t->out.Push(0, std::make_shared<Pkg>(key, Cmd::kClose));
+			goto exit;
+		}
+		if (!written.empty())
+			last_active = Clock::Time();
+		for (auto& pkg : written) {
+			Tracer::Stamp(pkg.get(), kTraceWritten);
+			Tracer::Finish(*pkg);
+		}
+		if (closed && out.empty())
+			goto exit;
+
+		if (last_active + 600 < Clock::Time()) {
+			LOG(ERROR) << "thread:" << key << " is dead";
+			goto exit;
+		}
+		if (!t->Alive(session)) {
+			// the server went away with its end of the stream
+			LOG(ERROR) << "thread:" << key << " tunnel lost";
+			goto exit;
+		}
+	}
+exit:
+	w->channel.Free(key);
+	LOG(INFO) << "thread:" << key << " exit";
+}
+
+static uint64_t NowUs()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(Clock::Now()).count();
+}
+
+// probe echo: our send time(8) then the server queue depth(4)
+static void ProcProbe(Tunnel* t, const Pkg& pkg, uint32_t local_depth)
+{
+	uint64_t sent_us;
+	uint32_t remote_depth;
+	if (pkg.data.size() < sizeof(sent_us) + sizeof(remote_depth)) {
+		LOG(ERROR) << "io socket recv bad probe len:" << pkg.data.size();
+		return;
+	}
+	std::memcpy(&sent_us, pkg.data.data(), sizeof(sent_us));
+	std::memcpy(&remote_depth, pkg.data.data() + sizeof(sent_us), sizeof(remote_depth));
+	uint64_t rtt = NowUs() - sent_us;
+	uint64_t srtt = t->srtt_us;
+	// as RFC 6298 does for rttvar
+	if (srtt) {
+		uint64_t dev = (rtt > srtt ? rtt - srtt : srtt - rtt);
+		t->jitter_us = (t->jitter_us * 3 + dev) / 4;
+		t->srtt_us = (srtt * 7 + rtt) / 8;
+	} else {
+		t->jitter_us = rtt / 2;
+		t->srtt_us = rtt;
+	}
+	t->depth = local_depth + remote_depth;
+	VLOG(1) << "tunnel:" << t->host << ":" << t->port << " rtt:" << rtt << "us"
+		<< " srtt:" << t->srtt_us << "us jitter:" << t->jitter_us << "us depth:" << t->depth;
+}
+
+static void ProcessIo(Worker* w, Tunnel* t, Transport& sk)
+{
+	// tells the tunnels apart in --record_file
+	static std::atomic<uint32_t> tunnel_seq{0};
+	uint32_t tunnel_id = ++tunnel_seq;
+	const uint64_t probe_us = w->opts.probe.count() * 1000;
+	const uint64_t tunnel_timeout_us = w->opts.tunnel_timeout.count() * 1000;
+	Crypt enc, dec;
+	// recv and decrypt, encrypt and send run on threads of their own
+	PkgPipe pipe(sk, enc, dec);
+	uint64_t last_probe = 0;
+	uint64_t last_recv = NowUs();
+	uint32_t local_depth = 0;
+	while (true) {
+		uint64_t now = NowUs();
+		uint64_t timeout_us = std::max<uint64_t>(tunnel_timeout_us,
+				probe_us + t->srtt_us + 4 * t->jitter_us);
+		if (now - last_recv > timeout_us) {
+			LOG(ERROR) << "tunnel:" << t->host << ":" << t->port << " silent for "
+				<< (now - last_recv) / 1000 << "ms, dead";
+			break;
+		}
+		if (now - last_probe >= probe_us) {
+			local_depth = static_cast<uint32_t>(t->out.Size(0));
+			t->out.Push(0, std::make_shared<Pkg>(0, Cmd::kProbe,
+						reinterpret_cast<const uint8_t*>(&now), sizeof(now)));
+			last_probe = now;
+		}
+
+		std::shared_ptr<Pkg> new_pkg;
+		// wait 50ms for pkg incoming, or for the tunnel to take more
+		// while it is backed up
+		int r = pipe.Read(&new_pkg, std::chrono::milliseconds(50));
+		if (r < 0) {
+			PLOG(INFO) << "io socket recv error";
+			break;
+		} else if (r == 0) {
+			last_recv = NowUs();
+			Tracer::Stamp(new_pkg.get(), kTraceTunnelRecv);
+			FrameRecorder::Frame(FrameDir::kIn, *new_pkg, tunnel_id);
+			LOG(INFO) << "io socket recv pkg {key:" << new_pkg->key
+				<< " cmd:" << static_cast<unsigned>(new_pkg->cmd)
+				<< " len:" << new_pkg->data.size() << "}";
+			if (new_pkg->cmd == Cmd::kProbe) {
+				ProcProbe(t, *new_pkg, local_depth);
+			} else {
+				Budget::ChargeStream(new_pkg.get());
+				w->channel.Push(new_pkg->key, new_pkg);
+			}
+		} else {
+			VLOG(1) << "io socket recv timeout";
+		}
+
+		bool sent = true;
+		while (sent && !pipe.Full()) {
+			auto pkg = t->out.Pop(0);
+			if (!pkg) {
+				VLOG(1) << "io channel empty";
+				break;
+			}
+			LOG(INFO) << "io channel recv pkg {key:" << pkg->key
+				<< " cmd:" << static_cast<unsigned>(pkg->cmd)
+				<< " len:" << pkg->data.size() << "}";
+			Tracer::Stamp(pkg.get(), kTraceDequeued);
+			FrameRecorder::Frame(FrameDir::kOut, *pkg, tunnel_id);
+			sent = pipe.Write(std::move(pkg));
+		}
+		// never block on the tunnel, what it does not take waits in the channel
+		if (!sent) {
+			PLOG(ERROR) << "io socket send pkg error";
+			break;
+		}
+		FrameRecorder::Flush();
+	}
+}
+
+void RunTunnel(Worker* w, Tunnel* t, Transport& sk)
+{
+	++t->session;
+	t->up = true;
+	ProcessIo(w, t, sk);
+	// the frames read before the tunnel failed
+	FrameRecorder::Flush();
+	t->up = false;
+	++t->session;
+	t->srtt_us = 0;
+	t->jitter_us = 0;
+	// connection loss
+	// w->channel.Broadcast(0, std::make_share<Pkg>(Cmd::kClose));
+}
+
+CFW_NS_END
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include "socket.h"
+#include "cfw_channel.h"
+
+CFW_NS_BEGIN
+
+// What the client handlers take from the command line
+struct ClientOptions
+{
+	// answer SOCKS5 locally and send CONNECT with early data in kConn
+	bool socks_local = false;
+	std::chrono::milliseconds early_data{5};
+	// plaintext per-stream connections to this server port, 0 to multiplex
+	uint16_t direct_port = 0;
+	// apps connect over a UNIX socket, they have no address
+	bool unix_listener = false;
+	std::chrono::milliseconds probe{1000};
+	std::chrono::milliseconds tunnel_timeout{5000};
+	SockOpts tunnel_opts;
+};
+
+// A connection to one server, kept up by its own io thread. Probes
+// measure the RTT including the time spent in the server queue, their
+// echoes keep the tunnel busy so a silent one is known dead.
+struct Tunnel
+{
+	Tunnel(const std::string& h, uint16_t p) : host(h), port(p) {}
+	std::string host;
+	uint16_t port;
+	// pkgs to send, key 0
+	Channel<Pkg> out;
+	std::atomic<bool> up{false};
+	std::atomic<uint64_t> srtt_us{0};
+	// smoothed deviation of the RTT samples from srtt_us
+	std::atomic<uint64_t> jitter_us{0};
+	// bumped by every connect and disconnect, odd while up
+	std::atomic<uint32_t> session{0};
+	// pkgs queued here and in the server at the last probe
+	std::atomic<uint32_t> depth{0};
+
+	uint64_t Cost() const {
+		return (srtt_us + 1) * (depth + 1);
+	}
+	// the server side of a stream started at session s is still there,
+	// one started while down goes out with the next connect
+	bool Alive(uint32_t s) const {
+		uint32_t now = session;
+		return now == s || (s % 2 == 0 && now == s + 1);
+	}
+};
+
+// Each worker owns a listener shard, a channel and its tunnels.
+// Streams stay on the worker that accepted them, so workers share
+// nothing on the data path and each can be pinned to its own core.
+struct Worker
+{
+	Worker(unsigned i, const ClientOptions& o) : id(i), opts(o) {}
+	unsigned id;
+	const ClientOptions& opts;
+	// pkgs from the tunnels, by stream key
+	Channel<Pkg> channel;
+	std::vector<std::unique_ptr<Tunnel>> tunnels;
+	// own or shared by all workers
+	TcpServerSocket* listener = nullptr;
+
+	// the cheapest tunnel that is up, the first one if none is
+	Tunnel* PickTunnel() {
+		Tunnel* best = nullptr;
+		for (auto& t : tunnels) {
+			if (t->up && (!best || t->Cost() < best->Cost()))
+				best = t.get();
+		}
+		return best ? best : tunnels[0].get();
+	}
+};
+
+// an accepted app connection, keyed by its address
+void HandleClient(Worker* w, TcpSocket csk);
+// SOCKS and then the relay of one app connection over a tunnel; UDP
+// ASSOCIATE and --direct_port need csk to be a TcpSocket
+void HandleStream(Worker* w, Transport& csk, Key key);
+// the tunnel t is connected over sk: bump its session, relay until it
+// fails or goes silent, bump it again
+void RunTunnel(Worker* w, Tunnel* t, Transport& sk);
+
+CFW_NS_END
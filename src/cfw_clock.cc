@@ -0,0 +1,165 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <glog/logging.h>
+#include "cfw_clock.h"
+
+CFW_NS_BEGIN
+
+// a thread of the virtual clock
+struct Clock::Slot
+{
+	std::condition_variable cond;
+	std::thread::id id;
+	bool started = false;
+	bool done = false;
+	bool waiting = false;
+	int64_t deadline = 0;
+	const std::function<int64_t()>* poll = nullptr;
+	std::list<std::shared_ptr<Slot>>::iterator pos;
+};
+
+bool Clock::virtual_ = false;
+static std::atomic<int64_t> g_now_ns{0};
+// guards the slots and the hand over between them
+static std::mutex g_mutex;
+// in start order, the turns go round in it
+static std::list<std::shared_ptr<Clock::Slot>> g_slots;
+static Clock::Slot* g_running = nullptr;
+static thread_local Clock::Slot* t_slot = nullptr;
+
+std::chrono::nanoseconds Clock::Now()
+{
+	if (virtual_)
+		return std::chrono::nanoseconds(g_now_ns.load(std::memory_order_relaxed));
+	return std::chrono::steady_clock::now().time_since_epoch();
+}
+
+time_t Clock::Time()
+{
+	if (virtual_)
+		return static_cast<time_t>(g_now_ns.load(std::memory_order_relaxed) / 1000000000);
+	return ::time(nullptr);
+}
+
+// when the wait of s ends by itself, kNever for never
+static int64_t WakeAt(const Clock::Slot& s)
+{
+	return std::min(s.deadline, (*s.poll)());
+}
+
+// with g_mutex held: give the turn to the next slot after self that can
+// run, moving time on when none can
+static void PassTurn(Clock::Slot* self)
+{
+	auto start = std::next(self->pos);
+	if (self->done)
+		g_slots.erase(self->pos);
+	while (true) {
+		int64_t now = g_now_ns.load(std::memory_order_relaxed);
+		int64_t next_wake = Clock::kNever;
+		// one lap from after self, self last
+		auto it = start;
+		for (size_t n = g_slots.size(); n > 0; --n, ++it) {
+			if (it == g_slots.end())
+				it = g_slots.begin();
+			Clock::Slot* s = it->get();
+			int64_t wake = (s->waiting ? WakeAt(*s) : now);
+			if (!s->started || wake <= now) {
+				s->started = true;
+				g_running = s;
+				s->cond.notify_one();
+				return;
+			}
+			next_wake = std::min(next_wake, wake);
+		}
+		CHECK(next_wake != Clock::kNever) << "virtual clock: every thread waits for another";
+		g_now_ns.store(next_wake, std::memory_order_relaxed);
+	}
+}
+
+void Clock::UseVirtual()
+{
+	virtual_ = true;
+	g_now_ns = 0;
+	auto s = std::make_shared<Slot>();
+	s->id = std::this_thread::get_id();
+	s->started = true;
+	s->pos = g_slots.insert(g_slots.end(), s);
+	g_running = t_slot = s.get();
+}
+
+void Clock::SleepFor(std::chrono::nanoseconds d)
+{
+	if (!virtual_) {
+		std::this_thread::sleep_for(d);
+		return;
+	}
+	WaitUntil(Now() + d, [] { return kNever; });
+}
+
+bool Clock::WaitUntil(std::chrono::nanoseconds deadline, const std::function<int64_t()>& poll)
+{
+	CHECK(virtual_ && t_slot) << "virtual clock wait from a thread it did not start";
+	std::unique_lock<std::mutex> lock(g_mutex);
+	Slot* self = t_slot;
+	self->waiting = true;
+	self->deadline = deadline.count();
+	self->poll = &poll;
+	if (WakeAt(*self) > g_now_ns.load(std::memory_order_relaxed)) {
+		PassTurn(self);
+		self->cond.wait(lock, [self] { return g_running == self; });
+	}
+	self->waiting = false;
+	return poll() <= g_now_ns.load(std::memory_order_relaxed);
+}
+
+Clock::Slot* Clock::AddSlot()
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	auto s = std::make_shared<Slot>();
+	s->pos = g_slots.insert(g_slots.end(), s);
+	return s.get();
+}
+
+void Clock::SetSlotId(Slot* s, std::thread::id id)
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	s->id = id;
+}
+
+void Clock::RunSlot(Slot* s, const std::function<void()>& fn)
+{
+	{
+		std::unique_lock<std::mutex> lock(g_mutex);
+		s->cond.wait(lock, [s] { return g_running == s; });
+	}
+	t_slot = s;
+	fn();
+	std::lock_guard<std::mutex> lock(g_mutex);
+	// keeps s alive until the turn is passed on
+	auto keep = *s->pos;
+	s->done = true;
+	PassTurn(s);
+}
+
+void Clock::Join(std::thread& th)
+{
+	if (virtual_) {
+		std::thread::id id = th.get_id();
+		// waits for the slot of th to leave the list
+		WaitUntil(std::chrono::nanoseconds(kNever), [id] {
+			for (auto& s : g_slots) {
+				if (s->id == id)
+					return kNever;
+			}
+			return int64_t(0);
+		});
+	}
+	th.join();
+}
+
+CFW_NS_END
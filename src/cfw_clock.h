@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "cfw.h"
+
+CFW_NS_BEGIN
+
+// Time and threads for the handlers the simulator drives (see cfw_sim.cc).
+// Normally these are the real clocks and plain std::threads. Under the
+// virtual clock the threads started here take turns, one running at a
+// time, and time only moves once every one of them waits: to the
+// earliest moment a wait ends. Runs are reproducible and simulated
+// minutes take no wall time.
+class Clock
+{
+public:
+	// for WaitUntil polls that only another thread can make ready
+	static constexpr int64_t kNever = INT64_MAX;
+	// a thread of the virtual clock, see cfw_clock.cc
+	struct Slot;
+
+	// monotonic
+	static std::chrono::nanoseconds Now();
+	// secs as ::time() gives them, for coarse timeouts
+	static time_t Time();
+	// switch the process to a virtual clock at 0, before any other
+	// thread reads the time; the caller becomes the first clock thread
+	static void UseVirtual();
+	static bool is_virtual() {
+		return virtual_;
+	}
+	static void SleepFor(std::chrono::nanoseconds d);
+	// virtual clock only: wait until poll() is at most Now() or until
+	// deadline, ret false on timeout. poll gives the time the awaited
+	// state comes about by itself, kNever if another thread must act;
+	// other threads call it while this one waits.
+	static bool WaitUntil(std::chrono::nanoseconds deadline, const std::function<int64_t()>& poll);
+	// std::thread(f, args...), under the virtual clock one that takes
+	// turns with the others; join it with Join()
+	template <class F, class... Args>
+	static std::thread Start(F&& f, Args&&... args) {
+		if (!virtual_)
+			return std::thread(std::forward<F>(f), std::forward<Args>(args)...);
+		Slot* s = AddSlot();
+		std::thread th([s](std::decay_t<F> fn, std::decay_t<Args>... a) {
+			RunSlot(s, [&] {
+				// f and its args go away while the thread has its turn
+				std::tuple<std::decay_t<F>, std::decay_t<Args>...> call(std::move(fn), std::move(a)...);
+				std::apply([](auto& g, auto&... x) { std::invoke(std::move(g), std::move(x)...); }, call);
+			});
+		}, std::forward<F>(f), std::forward<Args>(args)...);
+		SetSlotId(s, th.get_id());
+		return th;
+	}
+	static void Join(std::thread& th);
+
+private:
+	static Slot* AddSlot();
+	static void SetSlotId(Slot* s, std::thread::id id);
+	static void RunSlot(Slot* s, const std::function<void()>& fn);
+
+	static bool virtual_;
+};
+
+CFW_NS_END
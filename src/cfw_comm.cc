@@ -1,5 +1,9 @@
+#include <netdb.h>
+#include <poll.h>
 #include <time.h>
-#include <thread>
+#include <atomic>
+#include <cerrno>
+#include <algorithm>
 #include <cstring>
 #include <glog/logging.h>
 #include "socket.h"
@@ -14,48 +18,178 @@ uint64_t MakeKey(const SockAddrIn& addr)
 		+ (static_cast<uint64_t>(::time(nullptr)) & 0xffff));
 }
 
+uint64_t MakeKey()
+{
+	// 255.255.255.255 is never a peer, so this can't clash with the above
+	static std::atomic<uint32_t> seq{0};
+	return (static_cast<uint64_t>(0xffffffff) << 32) + (++seq);
+}
+
+bool ResolveIp(const char* url, uint32_t* net_order_ip)
+{
+	char buf[1024];
+	struct hostent entry, *result;
+	int error;
+	int r = ::gethostbyname_r(url, &entry, buf, sizeof(buf), &result, &error);
+	if (r) {
+		LOG(ERROR) << "gethostbyname ret:" << r << " h_errno:" << error;
+		return false;
+	} else if (!result) {
+		LOG(ERROR) << "gethostbyname resolve nothing";
+		return false;
+	}
+	struct in_addr* ia = reinterpret_cast<struct in_addr*>(entry.h_addr_list[0]);
+	*net_order_ip = ia->s_addr;
+	return true;
+}
+
+static void EncodePkg(Crypt& crypt, const Pkg& pkg, Bytes* out)
+{
+	size_t off = out->size();
+	uint32_t data_len = static_cast<uint32_t>(pkg.data.size());
+	uint8_t cmd = static_cast<uint8_t>(pkg.cmd) | pkg.flags;
+	CHECK(kPkgHeadLen + data_len <= sizeof(PkgBuffer)) << "SendPkg buf overflow!";
+	out->resize(off + kPkgHeadLen + data_len);
+	uint8_t* p = &(*out)[off];
+	std::memcpy(p, &pkg.key, sizeof(pkg.key));
+	std::memcpy(p + 8, &cmd, sizeof(cmd));
+	std::memcpy(p + 9, &data_len, sizeof(data_len));
+	std::memcpy(p + kPkgHeadLen, pkg.data.data(), data_len);
+	crypt.EncBuffer(p, kPkgHeadLen + data_len);
+}
+
 bool SendPkg(TcpSocket& sk, Crypt& crypt, const Pkg& pkg)
 {
-	PkgBuffer buf;
-	size_t off = 0;
-	size_t data_len = pkg.data.size();
-	*reinterpret_cast<uint64_t*>(&buf[off]) = pkg.key; off += sizeof(uint64_t);
-	*reinterpret_cast<uint8_t*>(&buf[off]) = static_cast<uint8_t>(pkg.cmd); off += sizeof(uint8_t);
-	*reinterpret_cast<uint32_t*>(&buf[off]) = static_cast<uint32_t>(data_len); off += sizeof(uint32_t);
-	CHECK(off + data_len <= sizeof(buf)) << "SendPkg buf overflow!";
-	std::memcpy(&buf[off], pkg.data.data(), data_len); off += data_len;
-	crypt.EncBuffer(buf.data(), off);
-	return sk.SendN(buf.data(), off);
+	Bytes buf;
+	EncodePkg(crypt, pkg, &buf);
+	return sk.SendN(buf.data(), buf.size());
+}
+
+void EncodePkgs(Crypt& crypt, const std::vector<std::shared_ptr<Pkg>>& pkgs, Bytes* out)
+{
+	for (auto& pkg : pkgs)
+		EncodePkg(crypt, *pkg, out);
+}
+
+bool Transport::ReadN(uint8_t* buf, size_t n, std::chrono::milliseconds msecs)
+{
+	Bytes got;
+	while (got.size() < n) {
+		if (RecvSome(&got, n - got.size(), msecs) <= 0)
+			return false;
+	}
+	std::memcpy(buf, got.data(), n);
+	return true;
 }
 
-int RecvPkg(TcpSocket& sk, Crypt& crypt, Pkg* pkg, std::chrono::milliseconds msecs)
+bool Transport::WriteN(const uint8_t* buf, size_t n, std::chrono::milliseconds msecs)
 {
-	Buffer buf;
+	size_t i = 0;
+	while (i < n) {
+		iovec iov = {const_cast<uint8_t*>(buf + i), n - i};
+		int r = SendSome(&iov, 1);
+		if (r > 0) {
+			i += r;
+			continue;
+		}
+		if (r < 0 && errno != EAGAIN)
+			return false;
+		int events = Poll(POLLOUT, msecs);
+		if (events <= 0) {
+			if (events == 0)
+				errno = ETIMEDOUT;
+			return false;
+		}
+	}
+	return true;
+}
+
+void OutBuffer::Append(Bytes data, std::shared_ptr<Pkg> pkg)
+{
+	if (data.empty())
+		return;
+	size_ += data.size();
+	chunks_.push_back({std::move(data), std::move(pkg)});
+}
+
+bool OutBuffer::Flush(Transport& sk, std::vector<std::shared_ptr<Pkg>>* done)
+{
+	const size_t kMaxIov = 64;
+	while (!chunks_.empty()) {
+		iovec iov[kMaxIov];
+		int cnt = 0;
+		for (auto it = chunks_.begin(); it != chunks_.end() && cnt < static_cast<int>(kMaxIov); ++it) {
+			size_t off = (cnt == 0 ? offset_ : 0);
+			iov[cnt++] = {const_cast<uint8_t*>(it->data.data()) + off, it->data.size() - off};
+		}
+		int r = sk.SendSome(iov, cnt);
+		if (r <= 0)
+			return r == 0 || errno == EAGAIN;
+		size_ -= r;
+		size_t left = r;
+		while (left > 0) {
+			Chunk& c = chunks_.front();
+			size_t n = std::min(left, c.data.size() - offset_);
+			offset_ += n;
+			left -= n;
+			if (offset_ == c.data.size()) {
+				if (done && c.pkg)
+					done->push_back(std::move(c.pkg));
+				chunks_.pop_front();
+				offset_ = 0;
+			}
+		}
+	}
+	return true;
+}
+
+bool PkgReader::Parse(Pkg* pkg)
+{
+	size_t avail = buf_.size() - pos_;
+	if (avail < kPkgHeadLen)
+		return false;
+	const uint8_t* p = &buf_[pos_];
 	uint32_t len;
+	std::memcpy(&pkg->key, p, sizeof(pkg->key));
+	pkg->cmd = static_cast<Cmd>(p[8] & ~kPkgFlagMask);
+	pkg->flags = p[8] & kPkgFlagMask;
+	std::memcpy(&len, p + 9, sizeof(len));
+	if (kPkgHeadLen + len > sizeof(PkgBuffer)) {
+		LOG(ERROR) << "io socket recv bad pkg len:" << len;
+		bad_ = true;
+		return false;
+	}
+	if (avail < kPkgHeadLen + len)
+		return false;
+	pkg->data.assign(p + kPkgHeadLen, len);
+	pos_ += kPkgHeadLen + len;
+	if (pos_ == buf_.size()) {
+		buf_.clear();
+		pos_ = 0;
+	}
+	return true;
+}
 
-	// todo: sk.WaitReadable(msecs);
-	// but now use naive code here
-	int r;
-	r = sk.Recv(buf.data(), 1, MSG_PEEK|MSG_DONTWAIT);
-	if (r < 0 && errno == EAGAIN) {
-		std::this_thread::sleep_for(msecs);
-		r = sk.Recv(buf.data(), 1, MSG_PEEK|MSG_DONTWAIT);
+int PkgReader::Read(Pkg* pkg, std::chrono::milliseconds msecs)
+{
+	if (Parse(pkg))
+		return 0;
+	if (bad_)
+		return -1;
+	if (pos_ > 0) {
+		buf_.erase(0, pos_);
+		pos_ = 0;
 	}
+	size_t old_size = buf_.size();
+	int r = sk_.RecvSome(&buf_, 16384, msecs);
 	if (r < 0 && errno == EAGAIN)
 		return 1;
 	else if (r <= 0)
 		return -1;
-	
-	if (!sk.RecvValue(&pkg->key)) return -1;
-	crypt.DecBuffer(reinterpret_cast<uint8_t*>(&pkg->key), sizeof(pkg->key));
-	if (!sk.RecvValue(&pkg->cmd)) return -1;
-	crypt.DecBuffer(reinterpret_cast<uint8_t*>(&pkg->cmd), sizeof(pkg->cmd));
-	if (!sk.RecvValue(&len)) return -1;
-	crypt.DecBuffer(reinterpret_cast<uint8_t*>(&len), sizeof(len));
-	if (!sk.RecvN(buf.data(), len)) return -1;
-	crypt.DecBuffer(buf.data(), len);
-	pkg->data.assign(buf.data(), len);
-	return 0;
+	crypt_.DecBuffer(&buf_[old_size], r);
+	if (Parse(pkg))
+		return 0;
+	return bad_ ? -1 : 1;
 }
 
 CFW_NS_END
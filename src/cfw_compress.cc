@@ -0,0 +1,236 @@
+#include <atomic>
+#include <cstring>
+#include <glog/logging.h>
+#include "cfw_compress.h"
+
+CFW_NS_BEGIN
+
+static const size_t kMinMatch = 4;
+static const size_t kLastLiterals = 5;
+static const size_t kMfLimit = 12;
+static const size_t kMaxInput = 65535;
+static const unsigned kHashLog = 12;
+
+static inline uint32_t Read32(const uint8_t* p)
+{
+	uint32_t v;
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t Hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - kHashLog);
+}
+
+static inline bool PutLength(size_t n, uint8_t** op, uint8_t* oend)
+{
+	for (; n >= 255; n -= 255) {
+		if (*op >= oend) return false;
+		*(*op)++ = 255;
+	}
+	if (*op >= oend) return false;
+	*(*op)++ = static_cast<uint8_t>(n);
+	return true;
+}
+
+// token, literals, then offset and match length unless it is the last one
+static bool PutSequence(const uint8_t* lit, size_t lit_len, size_t offset,
+		size_t match_len, bool last, uint8_t** op, uint8_t* oend)
+{
+	if (*op >= oend) return false;
+	uint8_t* token = (*op)++;
+	*token = static_cast<uint8_t>((lit_len < 15 ? lit_len : 15) << 4);
+	if (lit_len >= 15 && !PutLength(lit_len - 15, op, oend)) return false;
+	if (static_cast<size_t>(oend - *op) < lit_len) return false;
+	std::memcpy(*op, lit, lit_len);
+	*op += lit_len;
+	if (last)
+		return true;
+	if (oend - *op < 2) return false;
+	*(*op)++ = static_cast<uint8_t>(offset);
+	*(*op)++ = static_cast<uint8_t>(offset >> 8);
+	size_t ml = match_len - kMinMatch;
+	*token |= static_cast<uint8_t>(ml < 15 ? ml : 15);
+	if (ml >= 15 && !PutLength(ml - 15, op, oend)) return false;
+	return true;
+}
+
+size_t LzCompress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap)
+{
+	if (len > kMaxInput)
+		return 0;
+	const uint8_t* ip = src;
+	const uint8_t* anchor = src;
+	const uint8_t* iend = src + len;
+	uint8_t* op = dst;
+	uint8_t* oend = dst + cap;
+
+	if (len >= kMfLimit) {
+		int32_t table[1 << kHashLog];
+		std::memset(table, 0xff, sizeof(table));
+		const uint8_t* mflimit = iend - kMfLimit;
+		const uint8_t* matchlimit = iend - kLastLiterals;
+		unsigned searches = 0;
+		while (ip <= mflimit) {
+			uint32_t seq = Read32(ip);
+			uint32_t h = Hash(seq);
+			int32_t ref = table[h];
+			table[h] = static_cast<int32_t>(ip - src);
+			if (ref < 0 || Read32(src + ref) != seq) {
+				// step faster over data that doesn't match at all
+				ip += 1 + (searches++ >> 5);
+				continue;
+			}
+			searches = 0;
+			const uint8_t* match = src + ref;
+			while (ip > anchor && match > src && ip[-1] == match[-1]) {
+				--ip;
+				--match;
+			}
+			const uint8_t* mp = ip + kMinMatch;
+			const uint8_t* mm = match + kMinMatch;
+			while (mp < matchlimit && *mp == *mm) {
+				++mp;
+				++mm;
+			}
+			if (!PutSequence(anchor, ip - anchor, ip - match, mp - ip, false, &op, oend))
+				return 0;
+			ip = anchor = mp;
+		}
+	}
+	if (!PutSequence(anchor, iend - anchor, 0, 0, true, &op, oend))
+		return 0;
+	return op - dst;
+}
+
+static inline bool GetLength(const uint8_t** ip, const uint8_t* iend, size_t* n)
+{
+	uint8_t b;
+	do {
+		if (*ip >= iend) return false;
+		b = *(*ip)++;
+		*n += b;
+	} while (b == 255);
+	return true;
+}
+
+long LzDecompress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap)
+{
+	const uint8_t* ip = src;
+	const uint8_t* iend = src + len;
+	uint8_t* op = dst;
+	uint8_t* oend = dst + cap;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t lit_len = token >> 4;
+		if (lit_len == 15 && !GetLength(&ip, iend, &lit_len)) return -1;
+		if (lit_len > static_cast<size_t>(iend - ip)) return -1;
+		if (lit_len > static_cast<size_t>(oend - op)) return -1;
+		std::memcpy(op, ip, lit_len);
+		op += lit_len;
+		ip += lit_len;
+		if (ip == iend)
+			break;
+		if (iend - ip < 2) return -1;
+		size_t offset = ip[0] | (static_cast<size_t>(ip[1]) << 8);
+		ip += 2;
+		if (offset == 0 || offset > static_cast<size_t>(op - dst)) return -1;
+		size_t match_len = token & 15;
+		if (match_len == 15 && !GetLength(&ip, iend, &match_len)) return -1;
+		match_len += kMinMatch;
+		if (match_len > static_cast<size_t>(oend - op)) return -1;
+		// byte copy, the match may overlap the output
+		const uint8_t* m = op - offset;
+		for (size_t i = 0; i < match_len; ++i)
+			*op++ = *m++;
+	}
+	return op - dst;
+}
+
+// payloads smaller than this are not worth the try
+static const size_t kMinPackLen = 128;
+// misses in a row before backing off, a miss is a payload that
+// doesn't shrink by at least 1/8
+static const unsigned kMaxMisses = 4;
+static const unsigned kMinBackoff = 16;
+static const unsigned kMaxBackoff = 1024;
+
+static std::atomic<bool> g_enabled{false};
+static std::atomic<uint64_t> g_raw_bytes{0};
+static std::atomic<uint64_t> g_wire_bytes{0};
+static std::atomic<uint64_t> g_backoffs{0};
+
+void Compressor::Enable(bool on)
+{
+	g_enabled = on;
+}
+
+void Compressor::Pack(const uint8_t* buf, size_t len, Pkg* pkg)
+{
+	pkg->flags &= ~kPkgFlagLz;
+	if (!g_enabled) {
+		pkg->data.assign(buf, len);
+		return;
+	}
+	g_raw_bytes += len;
+	if (len < kMinPackLen || skip_ > 0) {
+		if (skip_ > 0)
+			--skip_;
+		pkg->data.assign(buf, len);
+		g_wire_bytes += len;
+		return;
+	}
+	PkgBuffer out;
+	size_t cap = len - len / 8;
+	size_t n = LzCompress(buf, len, out.data(), cap < sizeof(out) ? cap : sizeof(out));
+	if (n == 0) {
+		if (++misses_ >= kMaxMisses) {
+			backoff_ = (backoff_ ? backoff_ * 2 : kMinBackoff);
+			if (backoff_ > kMaxBackoff)
+				backoff_ = kMaxBackoff;
+			skip_ = backoff_;
+			misses_ = 0;
+			++g_backoffs;
+		}
+		pkg->data.assign(buf, len);
+		g_wire_bytes += len;
+		return;
+	}
+	misses_ = 0;
+	backoff_ = 0;
+	pkg->data.assign(out.data(), n);
+	pkg->flags |= kPkgFlagLz;
+	g_wire_bytes += n;
+}
+
+std::string Compressor::StatsString()
+{
+	uint64_t raw = g_raw_bytes;
+	uint64_t wire = g_wire_bytes;
+	char str[128];
+	snprintf(str, sizeof(str), "compress raw:%llu wire:%llu ratio:%.3f backoffs:%llu",
+			static_cast<unsigned long long>(raw),
+			static_cast<unsigned long long>(wire),
+			raw ? static_cast<double>(wire) / raw : 1.0,
+			static_cast<unsigned long long>(g_backoffs.load()));
+	return str;
+}
+
+bool Decompress(Pkg* pkg)
+{
+	if (!(pkg->flags & kPkgFlagLz))
+		return true;
+	PkgBuffer out;
+	long n = LzDecompress(pkg->data.data(), pkg->data.size(), out.data(), sizeof(out));
+	if (n < 0) {
+		LOG(ERROR) << "key:" << pkg->key << " corrupted compressed payload";
+		return false;
+	}
+	pkg->data.assign(out.data(), n);
+	pkg->flags &= ~kPkgFlagLz;
+	return true;
+}
+
+CFW_NS_END
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include "cfw.h"
+
+CFW_NS_BEGIN
+
+// LZ4 block format codec, input limited to 64KB (16 bits offsets).
+// ret compressed size, 0 if it doesn't fit in cap
+size_t LzCompress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap);
+// ret decompressed size, -1 on corrupted input or overflow
+long LzDecompress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap);
+
+// Per-stream compression stage for kData payloads. Payloads that don't
+// shrink are sent raw; after a few misses in a row (TLS, video...) the
+// stream stops trying for an exponentially growing number of payloads.
+class Compressor
+{
+public:
+	// fill pkg->data with buf, compressed if that pays off
+	void Pack(const uint8_t* buf, size_t len, Pkg* pkg);
+
+	static void Enable(bool on);
+	static std::string StatsString();
+
+private:
+	unsigned misses_ = 0;
+	unsigned skip_ = 0;
+	unsigned backoff_ = 0;
+};
+
+// undo Compressor::Pack in place, ret false on corrupted payload
+bool Decompress(Pkg* pkg);
+
+CFW_NS_END
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <new>
+#include <vector>
+#include <glog/logging.h>
+#include "cfw_egress.h"
+
+CFW_NS_BEGIN
+
+// round robin cursors, destinations hashing to the same one share it
+static const size_t kCursors = 65536;
+
+namespace {
+
+// mapped shared before the tunnel processes fork, so the cursors and
+// counters are server wide
+struct EgressShared
+{
+	std::atomic<uint32_t> next[kCursors];
+	std::atomic<uint64_t> connects{0};
+	std::atomic<uint64_t> failed{0};
+	std::atomic<uint64_t> exhausted{0};
+	std::atomic<uint64_t> failovers{0};
+};
+
+} // namespace
+
+static std::vector<uint32_t> g_ips;
+static EgressShared* g_shared = nullptr;
+
+bool Egress::Configure(const std::string& ips)
+{
+	g_ips.clear();
+	size_t pos = 0;
+	while (pos < ips.size()) {
+		size_t comma = ips.find(',', pos);
+		if (comma == std::string::npos)
+			comma = ips.size();
+		std::string ip = ips.substr(pos, comma - pos);
+		in_addr addr;
+		if (inet_pton(AF_INET, ip.c_str(), &addr) != 1) {
+			LOG(ERROR) << "bad egress ip:" << ip;
+			return false;
+		}
+		g_ips.push_back(ntohl(addr.s_addr));
+		pos = comma + 1;
+	}
+	if (!g_shared) {
+		void* p = ::mmap(nullptr, sizeof(EgressShared), PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) {
+			PLOG(ERROR) << "mmap egress cursors";
+			return false;
+		}
+		g_shared = new (p) EgressShared;
+	}
+	return true;
+}
+
+// Connect() works unconfigured too, it just counts nothing
+static void Count(std::atomic<uint64_t> EgressShared::* counter)
+{
+	if (g_shared)
+		++(g_shared->*counter);
+}
+
+static size_t NextIndex(const SockAddrIn& dst)
+{
+	uint64_t id = (static_cast<uint64_t>(dst.ip()) << 16) | dst.port();
+	size_t slot = ((id * 0x9e3779b97f4a7c15ull) >> 32) % kCursors;
+	return g_shared->next[slot].fetch_add(1, std::memory_order_relaxed) % g_ips.size();
+}
+
+std::shared_ptr<TcpSocket> Egress::Connect(const SockAddrIn& dst, const SockOpts& opts)
+{
+	size_t tries = g_ips.empty() ? 1 : g_ips.size();
+	size_t first = g_ips.empty() ? 0 : NextIndex(dst);
+	int err = 0;
+	for (size_t i = 0; i < tries; ++i) {
+		auto sk = std::make_shared<TcpSocket>();
+		PLOG_IF(WARNING, !sk->SetOpts(opts)) << "set upstream sockopts";
+		if (!g_ips.empty()) {
+			// no port is taken here, so a failure is a bad address
+			SockAddrIn src(g_ips[(first + i) % g_ips.size()], 0);
+			if (!sk->SetBindAddressNoPort() || !sk->Bind(src)) {
+				err = errno;
+				PLOG(ERROR) << "bind egress ip " << src.to_str();
+				continue;
+			}
+		}
+		if (sk->Connect(dst)) {
+			Count(&EgressShared::connects);
+			if (i > 0)
+				Count(&EgressShared::failovers);
+			return sk;
+		}
+		err = errno;
+		// no local port left for this 4-tuple
+		if (err != EADDRNOTAVAIL)
+			break;
+		Count(&EgressShared::exhausted);
+		LOG(WARNING) << "no local port left towards " << dst.to_str()
+			<< (g_ips.empty() ? "" : ", trying the next egress ip");
+	}
+	Count(&EgressShared::failed);
+	errno = err;
+	return nullptr;
+}
+
+std::string Egress::StatsString()
+{
+	if (!g_shared)
+		return "egress off";
+	char str[160];
+	snprintf(str, sizeof(str), "egress ips:%zu connects:%llu failed:%llu exhausted:%llu failovers:%llu",
+			g_ips.size(),
+			static_cast<unsigned long long>(g_shared->connects.load()),
+			static_cast<unsigned long long>(g_shared->failed.load()),
+			static_cast<unsigned long long>(g_shared->exhausted.load()),
+			static_cast<unsigned long long>(g_shared->failovers.load()));
+	return str;
+}
+
+CFW_NS_END
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include "socket.h"
+
+CFW_NS_BEGIN
+
+// Source addresses for upstream connects. Each destination walks the
+// pool round robin, and sockets bind with IP_BIND_ADDRESS_NO_PORT so
+// the port is picked at connect() per 4-tuple: every address adds a
+// full ephemeral port range towards each destination. A connect that
+// runs out of ports moves on to the next address.
+class Egress
+{
+public:
+	// ips: a,b,c... empty to connect from the default source address;
+	// before the tunnel processes fork, they share the cursors
+	static bool Configure(const std::string& ips);
+	// ret a connected socket, nullptr with errno set on failure
+	static std::shared_ptr<TcpSocket> Connect(const SockAddrIn& dst, const SockOpts& opts);
+	static std::string StatsString();
+};
+
+CFW_NS_END
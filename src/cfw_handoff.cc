@@ -0,0 +1,90 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <glog/logging.h>
+#include "socket.h"
+#include "cfw_handoff.h"
+
+CFW_NS_BEGIN
+
+// steps after the fds: the new process acks them, then the old one
+// tells it the path is free to listen on
+static const uint8_t kAck = 1;
+static const uint8_t kReleased = 2;
+
+static std::atomic<bool> g_draining{false};
+static int g_listen_fd = -1;
+
+static void CloseInChild()
+{
+	if (g_listen_fd >= 0)
+		::close(g_listen_fd);
+	g_listen_fd = -1;
+}
+
+bool Handoff::Take(const std::string& path, std::vector<int>* fds)
+{
+	UnixSocket sk;
+	if (!sk.Connect(SockAddrUn(path)))
+		return false;
+	PCHECK(sk.SetRecvTimeout(std::chrono::seconds(10)));
+	uint8_t released;
+	if (!sk.RecvFds(fds)) {
+		PLOG(ERROR) << "handoff recv listeners";
+		return false;
+	}
+	if (!sk.SendValue(kAck) || !sk.RecvValue(&released) || released != kReleased) {
+		PLOG(ERROR) << "handoff not completed";
+		for (int fd : *fds)
+			::close(fd);
+		fds->clear();
+		return false;
+	}
+	LOG(INFO) << "took over " << fds->size() << " listeners on " << path;
+	return true;
+}
+
+static void ServeThread(std::unique_ptr<UnixServerSocket> ssk, SockAddrUn addr, std::vector<int> fds)
+{
+	while (true) {
+		UnixSocket csk(ssk->Accept());
+		if (!csk) {
+			PLOG(ERROR) << "handoff accept";
+			return;
+		}
+		uint8_t ack;
+		PCHECK(csk.SetRecvTimeout(std::chrono::seconds(10)));
+		if (!csk.SendFds(fds) || !csk.RecvValue(&ack) || ack != kAck) {
+			PLOG(WARNING) << "handoff to the new process failed, keep serving";
+			continue;
+		}
+		// from here the new process owns the listeners
+		g_draining = true;
+		g_listen_fd = -1;
+		ssk.reset();
+		if (!addr.abstract())
+			::unlink(addr.path().c_str());
+		csk.SendValue(kReleased);
+		LOG(INFO) << "listeners handed off, draining";
+		return;
+	}
+}
+
+void Handoff::Serve(const std::string& path, std::vector<int> fds)
+{
+	SockAddrUn addr(path);
+	std::unique_ptr<UnixServerSocket> ssk(new UnixServerSocket(addr));
+	PCHECK(ssk->Listen()) << "listen " << path;
+	g_listen_fd = ssk->sock();
+	::pthread_atfork(nullptr, nullptr, CloseInChild);
+	std::thread(ServeThread, std::move(ssk), addr, std::move(fds)).detach();
+}
+
+bool Handoff::draining()
+{
+	return g_draining;
+}
+
+CFW_NS_END
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "cfw.h"
+
+CFW_NS_BEGIN
+
+// Graceful restart. A running process serves its listening sockets on
+// a UNIX socket; a new build started with the same path takes them
+// over with SCM_RIGHTS instead of binding its own, so no connection is
+// refused in between. The old process then stops accepting and drains
+// the streams it has.
+class Handoff
+{
+public:
+	// take the listeners of the process serving path,
+	// ret false if none answers (start fresh then)
+	static bool Take(const std::string& path, std::vector<int>* fds);
+	// hand fds to the next process that asks on path, from a thread;
+	// call after daemon(), children forked later drop the path
+	static void Serve(const std::string& path, std::vector<int> fds);
+	// set once the listeners are handed off, accept loops stop then
+	static bool draining();
+};
+
+CFW_NS_END
@@ -0,0 +1,122 @@
+#include <errno.h>
+#include <poll.h>
+#include <algorithm>
+#include "cfw_clock.h"
+#include "cfw_memlink.h"
+
+CFW_NS_BEGIN
+
+size_t MemLink::Write(const uint8_t* data, size_t len)
+{
+	size_t take = std::min(len, params_.buffer > queued_ ? params_.buffer - queued_ : 0);
+	int64_t now = Clock::Now().count();
+	std::uniform_real_distribution<double> draw(0, 1);
+	for (size_t off = 0; off < take; off += kMss) {
+		size_t n = std::min(kMss, take - off);
+		int64_t tx_ns = params_.bandwidth ? static_cast<int64_t>(n * 1e9 / params_.bandwidth) : 0;
+		free_ns_ = std::max(free_ns_, now) + tx_ns;
+		int64_t arrive = free_ns_ + std::chrono::nanoseconds(params_.latency).count();
+		if (params_.loss > 0 && draw(rng_) < params_.loss) {
+			arrive += std::chrono::nanoseconds(params_.rto).count();
+			++lost_;
+		}
+		// in order, a late segment holds up the ones behind it
+		last_arrive_ns_ = std::max(last_arrive_ns_, arrive);
+		segs_.push_back({last_arrive_ns_, Bytes(data + off, n)});
+	}
+	queued_ += take;
+	return take;
+}
+
+size_t MemLink::Read(Bytes* out, size_t max)
+{
+	int64_t now = Clock::Now().count();
+	size_t got = 0;
+	while (got < max && !segs_.empty() && segs_.front().arrive_ns <= now) {
+		Segment& s = segs_.front();
+		size_t n = std::min(max - got, s.data.size() - read_off_);
+		out->append(s.data, read_off_, n);
+		read_off_ += n;
+		got += n;
+		if (read_off_ == s.data.size()) {
+			segs_.pop_front();
+			read_off_ = 0;
+		}
+	}
+	queued_ -= got;
+	return got;
+}
+
+int64_t MemLink::ReadyAt() const
+{
+	if (!segs_.empty())
+		return segs_.front().arrive_ns;
+	return closed_ ? 0 : Clock::kNever;
+}
+
+std::pair<std::unique_ptr<MemTransport>, std::unique_ptr<MemTransport>>
+MemTransport::Pair(const LinkParams& params, uint32_t seed)
+{
+	auto ab = std::make_shared<MemLink>(params, seed);
+	auto ba = std::make_shared<MemLink>(params, seed + 1);
+	return {std::unique_ptr<MemTransport>(new MemTransport(ba, ab)),
+		std::unique_ptr<MemTransport>(new MemTransport(ab, ba))};
+}
+
+int MemTransport::RecvSome(Bytes* out, size_t max, std::chrono::milliseconds msecs)
+{
+	if (msecs.count() > 0)
+		Clock::WaitUntil(Clock::Now() + msecs, [this] { return in_->ReadyAt(); });
+	size_t n = in_->Read(out, max);
+	if (n > 0)
+		return static_cast<int>(n);
+	if (in_->eof())
+		return 0;
+	errno = EAGAIN;
+	return -1;
+}
+
+int MemTransport::SendSome(const iovec* iov, int cnt)
+{
+	if (out_->abandoned()) {
+		errno = EPIPE;
+		return -1;
+	}
+	size_t sent = 0;
+	for (int i = 0; i < cnt; ++i) {
+		size_t n = out_->Write(static_cast<const uint8_t*>(iov[i].iov_base), iov[i].iov_len);
+		sent += n;
+		if (n < iov[i].iov_len)
+			break;
+	}
+	if (sent == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return static_cast<int>(sent);
+}
+
+int MemTransport::Poll(short events, std::chrono::milliseconds msecs)
+{
+	auto ready = [this, events] {
+		int64_t at = Clock::kNever;
+		if (events & POLLIN)
+			at = in_->ReadyAt();
+		if ((events & POLLOUT) && (out_->room() || out_->abandoned()))
+			at = 0;
+		return at;
+	};
+	if (!Clock::WaitUntil(Clock::Now() + msecs, ready))
+		return 0;
+	int revents = 0;
+	int64_t now = Clock::Now().count();
+	if ((events & POLLIN) && in_->ReadyAt() <= now)
+		revents |= POLLIN;
+	if ((events & POLLOUT) && out_->room())
+		revents |= POLLOUT;
+	if (out_->abandoned())
+		revents |= POLLERR;
+	return revents;
+}
+
+CFW_NS_END
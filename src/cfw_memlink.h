@@ -0,0 +1,98 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <random>
+#include <utility>
+#include "cfw.h"
+
+CFW_NS_BEGIN
+
+struct LinkParams
+{
+	std::chrono::microseconds latency{0};	// one way
+	uint64_t bandwidth = 0;	// bytes/s, 0 for no limit
+	// share of segments lost, each arrives an rto late and holds up
+	// what follows it as TCP would
+	double loss = 0;
+	std::chrono::microseconds rto{200000};
+	// bytes in flight before the sender is told EAGAIN
+	size_t buffer = 1 << 20;
+};
+
+// One direction of an in-memory connection, timed by Clock. Not
+// thread safe, the virtual clock runs one thread at a time.
+class MemLink
+{
+public:
+	MemLink(const LinkParams& params, uint32_t seed) : params_(params), rng_(seed) {}
+	// ret bytes taken, 0 when the buffer is full
+	size_t Write(const uint8_t* data, size_t len);
+	// append the bytes arrived by now to *out, at most max
+	size_t Read(Bytes* out, size_t max);
+	void Close() {
+		closed_ = true;
+	}
+	// the reader went away, writes fail from now on
+	void Abandon() {
+		abandoned_ = true;
+	}
+	bool eof() const {
+		return closed_ && segs_.empty();
+	}
+	bool abandoned() const {
+		return abandoned_;
+	}
+	bool room() const {
+		return queued_ < params_.buffer;
+	}
+	// when Read gets bytes or EOF, Clock::kNever when the writer must act
+	int64_t ReadyAt() const;
+	uint64_t lost() const {
+		return lost_;
+	}
+private:
+	static constexpr size_t kMss = 1448;
+	struct Segment {
+		int64_t arrive_ns;
+		Bytes data;
+	};
+	LinkParams params_;
+	std::mt19937 rng_;
+	std::deque<Segment> segs_;
+	size_t queued_ = 0;
+	size_t read_off_ = 0;	// into the first segment
+	int64_t free_ns_ = 0;	// the link has sent what it took by then
+	int64_t last_arrive_ns_ = 0;
+	uint64_t lost_ = 0;
+	bool closed_ = false;
+	bool abandoned_ = false;
+};
+
+// An end of an in-memory connection. Its waits are waits of the
+// virtual clock, which moves time on to the next arrival.
+class MemTransport : public Transport
+{
+public:
+	MemTransport(std::shared_ptr<MemLink> in, std::shared_ptr<MemLink> out)
+		: in_(std::move(in)), out_(std::move(out)) {}
+	~MemTransport() {
+		out_->Close();
+		in_->Abandon();
+	}
+	// a connected pair over two links with the same params
+	static std::pair<std::unique_ptr<MemTransport>, std::unique_ptr<MemTransport>>
+		Pair(const LinkParams& params, uint32_t seed);
+	int RecvSome(Bytes* out, size_t max, std::chrono::milliseconds msecs) override;
+	int SendSome(const iovec* iov, int cnt) override;
+	int Poll(short events, std::chrono::milliseconds msecs) override;
+	uint64_t lost() const {
+		return out_->lost();
+	}
+private:
+	std::shared_ptr<MemLink> in_;
+	std::shared_ptr<MemLink> out_;
+};
+
+CFW_NS_END
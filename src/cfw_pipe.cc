@@ -0,0 +1,140 @@
+#include <errno.h>
+#include <poll.h>
+#include <glog/logging.h>
+#include "cfw_pipe.h"
+#include "cfw_trace.h"
+
+CFW_NS_BEGIN
+
+// how often the stages look at stop_ while idle
+static const std::chrono::milliseconds kIdleWait(50);
+
+PkgPipe::PkgPipe(Transport& sk, Crypt& enc, Crypt& dec) : sk_(sk), enc_(enc), dec_(dec)
+{
+	recv_thread_ = Clock::Start(&PkgPipe::RecvLoop, this);
+	send_thread_ = Clock::Start(&PkgPipe::SendLoop, this);
+}
+
+PkgPipe::~PkgPipe()
+{
+	stop_ = true;
+	recv_.Wake();
+	send_.Wake();
+	Clock::Join(recv_thread_);
+	Clock::Join(send_thread_);
+}
+
+void PkgPipe::RecvLoop()
+{
+	PkgReader reader(sk_, dec_);
+	while (!stop_) {
+		if (in_bytes_.load(std::memory_order_acquire) >= kMaxQueued || in_.full()) {
+			// the tunnel thread is behind, leave the data in the socket
+			recv_.Wait(kIdleWait, [this] {
+				return stop_ || (in_bytes_.load(std::memory_order_acquire) < kMaxQueued && !in_.full());
+			});
+			continue;
+		}
+		auto pkg = std::make_shared<Pkg>();
+		int r = reader.Read(pkg.get(), kIdleWait);
+		if (r == 1)
+			continue;
+		if (r < 0) {
+			in_errno_ = errno;
+			in_done_.store(true, std::memory_order_release);
+			tunnel_.Wake();
+			return;
+		}
+		size_t n = Cost(*pkg);
+		in_.Push(std::move(pkg));
+		in_bytes_.fetch_add(n, std::memory_order_release);
+		tunnel_.Wake();
+	}
+}
+
+void PkgPipe::SendLoop()
+{
+	OutBuffer out;
+	std::vector<std::shared_ptr<Pkg>> pkgs;
+	while (!stop_) {
+		// encode what is queued while the socket has room for more
+		std::shared_ptr<Pkg> pkg;
+		size_t taken = 0;
+		while (out.size() < kOutBufferLimit && out_.Pop(&pkg)) {
+			taken += Cost(*pkg);
+			pkgs.push_back(std::move(pkg));
+		}
+		if (!pkgs.empty()) {
+			Bytes buf;
+			EncodePkgs(enc_, pkgs, &buf);
+			out.Append(std::move(buf));
+			for (auto& p : pkgs) {
+				Tracer::Stamp(p.get(), kTraceSent);
+				Tracer::Finish(*p);
+			}
+			// gives their budget back
+			pkgs.clear();
+			out_bytes_.fetch_sub(taken, std::memory_order_release);
+			tunnel_.Wake();
+		}
+		if (out.empty()) {
+			send_.Wait(kIdleWait, [this] { return stop_ || !out_.empty(); });
+			continue;
+		}
+		if (!out.Flush(sk_)) {
+			out_errno_ = errno;
+			out_failed_.store(true, std::memory_order_release);
+			tunnel_.Wake();
+			return;
+		}
+		if (!out.empty())
+			sk_.Poll(POLLOUT, kIdleWait);
+	}
+}
+
+int PkgPipe::Read(std::shared_ptr<Pkg>* pkg, std::chrono::milliseconds msecs)
+{
+	tunnel_.Wait(msecs, [this] {
+		return !in_.empty() || in_done_.load(std::memory_order_acquire) ||
+			out_failed_.load(std::memory_order_acquire) || (blocked_ && !SendFull());
+	});
+	if (in_.Pop(pkg)) {
+		in_bytes_.fetch_sub(Cost(**pkg), std::memory_order_acq_rel);
+		recv_.Wake();
+		return 0;
+	}
+	// the recv stage pushed all it had before it set in_done_
+	if (in_done_.load(std::memory_order_acquire) && in_.empty()) {
+		errno = in_errno_;
+		return -1;
+	}
+	if (out_failed_.load(std::memory_order_acquire)) {
+		errno = out_errno_;
+		return -1;
+	}
+	return 1;
+}
+
+bool PkgPipe::Full()
+{
+	blocked_ = SendFull();
+	return blocked_;
+}
+
+bool PkgPipe::Write(std::shared_ptr<Pkg> pkg)
+{
+	if (out_failed_.load(std::memory_order_acquire)) {
+		errno = out_errno_;
+		return false;
+	}
+	size_t n = Cost(*pkg);
+	if (!out_.Push(std::move(pkg))) {
+		errno = ENOBUFS;
+		return false;
+	}
+	out_bytes_.fetch_add(n, std::memory_order_release);
+	send_.Wake();
+	return true;
+}
+
+CFW_NS_END
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "cfw.h"
+#include "cfw_clock.h"
+
+CFW_NS_BEGIN
+
+// Lock-free ring for one producer and one consumer thread
+template <class T>
+class SpscQueue
+{
+public:
+	// capacity is rounded up to a power of 2
+	explicit SpscQueue(size_t capacity) {
+		size_t n = 1;
+		while (n < capacity)
+			n <<= 1;
+		ring_.resize(n);
+		mask_ = n - 1;
+	}
+	SpscQueue(const SpscQueue&) = delete;
+	SpscQueue& operator=(const SpscQueue&) = delete;
+	// ret false when full, v is left alone then
+	bool Push(T&& v) {
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		if (tail - head_.load(std::memory_order_acquire) > mask_)
+			return false;
+		ring_[tail & mask_] = std::move(v);
+		tail_.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+	// ret false when empty
+	bool Pop(T* v) {
+		size_t head = head_.load(std::memory_order_relaxed);
+		if (head == tail_.load(std::memory_order_acquire))
+			return false;
+		*v = std::move(ring_[head & mask_]);
+		head_.store(head + 1, std::memory_order_release);
+		return true;
+	}
+	bool empty() const {
+		return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+	}
+	// exact for the producer, the consumer only makes room
+	bool full() const {
+		return tail_.load(std::memory_order_relaxed) - head_.load(std::memory_order_acquire) > mask_;
+	}
+private:
+	std::vector<T> ring_;
+	size_t mask_;
+	alignas(64) std::atomic<size_t> head_{0};	// next to pop
+	alignas(64) std::atomic<size_t> tail_{0};	// next to push
+};
+
+// Sleeps a consumer until a producer has news for it. Producers only
+// take the lock when the consumer is asleep.
+class Parker
+{
+public:
+	// wait at most msecs unless ready() is or turns true
+	template <class F>
+	void Wait(std::chrono::milliseconds msecs, F ready) {
+		if (ready())
+			return;
+		if (Clock::is_virtual()) {
+			// the other clock threads only run while this one waits
+			Clock::WaitUntil(Clock::Now() + msecs, [&] { return ready() ? 0 : Clock::kNever; });
+			return;
+		}
+		std::unique_lock<std::mutex> lock(mutex_);
+		waiting_.store(true, std::memory_order_seq_cst);
+		cond_.wait_for(lock, msecs, ready);
+		waiting_.store(false, std::memory_order_relaxed);
+	}
+	void Wake() {
+		// orders the caller's news before the look at waiting_
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiting_.load(std::memory_order_relaxed)) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			cond_.notify_one();
+		}
+	}
+private:
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::atomic<bool> waiting_{false};
+};
+
+// A tunnel with each direction on a thread of its own: the recv stage
+// reads, decrypts and splits pkgs, the send stage encodes, encrypts and
+// writes them. enc and dec are separate streams, so each advances in
+// order on its direction's thread, and the tunnel thread only moves pkgs
+// between the pipe and the channels. Pkgs pass between the threads
+// through SpscQueues; each direction holds at most kMaxQueued bytes.
+class PkgPipe
+{
+public:
+	// sk, enc and dec must outlive this, sk is left open
+	PkgPipe(Transport& sk, Crypt& enc, Crypt& dec);
+	PkgPipe(const PkgPipe&) = delete;
+	PkgPipe& operator=(const PkgPipe&) = delete;
+	~PkgPipe();
+	// the next pkg from the tunnel, waiting at most msecs; also returns
+	// early when the send stage has room again after Full()
+	// ret 0:ok 1:timeout -1:error or closed
+	int Read(std::shared_ptr<Pkg>* pkg, std::chrono::milliseconds msecs);
+	// the send stage holds enough, leave further pkgs in the channel
+	bool Full();
+	// hand pkg to the send stage, only while !Full()
+	// ret false (errno) once sending failed
+	bool Write(std::shared_ptr<Pkg> pkg);
+
+	static const size_t kMaxQueued = 4 << 20;
+private:
+	void RecvLoop();
+	void SendLoop();
+	bool SendFull() const {
+		return out_bytes_.load(std::memory_order_acquire) >= kMaxQueued || out_.full();
+	}
+	static size_t Cost(const Pkg& pkg) {
+		return kPkgHeadLen + pkg.data.size();
+	}
+
+	Transport& sk_;
+	Crypt& enc_;
+	Crypt& dec_;
+	std::atomic<bool> stop_{false};
+	// recv stage -> tunnel thread
+	SpscQueue<std::shared_ptr<Pkg>> in_{4096};
+	std::atomic<size_t> in_bytes_{0};
+	std::atomic<bool> in_done_{false};
+	int in_errno_ = 0;	// of the read that ended the stage
+	// tunnel thread -> send stage
+	SpscQueue<std::shared_ptr<Pkg>> out_{4096};
+	std::atomic<size_t> out_bytes_{0};
+	std::atomic<bool> out_failed_{false};
+	int out_errno_ = 0;
+	bool blocked_ = false;	// the last Full() was true
+	// the tunnel thread, the recv stage and the send stage sleep here
+	Parker tunnel_, recv_, send_;
+	std::thread recv_thread_;
+	std::thread send_thread_;
+};
+
+CFW_NS_END
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <glog/logging.h>
+#include "cfw_egress.h"
+#include "cfw_preconnect.h"
+
+CFW_NS_BEGIN
+
+// decayed hits that make a destination hot
+static const double kHotHits = 2;
+static const time_t kDecaySecs = 10;
+// wait before trying a destination again whose connect failed
+static const time_t kRetrySecs = 10;
+
+namespace {
+
+struct Dest
+{
+	double hits = 0;
+	time_t retry_at = 0;
+	// a FillDest thread is connecting
+	bool filling = false;
+	// connected at
+	std::deque<std::pair<std::shared_ptr<TcpSocket>, time_t>> idle;
+};
+
+} // namespace
+
+static size_t g_per_dest = 0;
+static size_t g_max_dests = 0;
+static time_t g_idle_secs = 0;
+static SockOpts g_opts;
+static std::mutex g_mutex;
+static std::condition_variable g_cond;
+// by destination ip:port
+static std::map<uint64_t, Dest> g_dests;
+static std::once_flag g_started;
+static std::atomic<uint64_t> g_hits{0};
+static std::atomic<uint64_t> g_misses{0};
+static std::atomic<uint64_t> g_made{0};
+static std::atomic<uint64_t> g_expired{0};
+
+static uint64_t DestId(const SockAddrIn& dst)
+{
+	return (static_cast<uint64_t>(dst.ip()) << 16) | dst.port();
+}
+
+void PreConnect::Configure(size_t per_dest, size_t max_dests, std::chrono::seconds idle,
+		const SockOpts& opts)
+{
+	g_per_dest = per_dest;
+	g_max_dests = max_dests;
+	g_idle_secs = idle.count();
+	g_opts = opts;
+	// the connect has to be done before the socket is pooled
+	g_opts.fastopen = -1;
+}
+
+// closed by the peer while idle; data it sent first is fine, it goes
+// to the stream
+static bool PeerClosed(TcpSocket& sk)
+{
+	uint8_t c;
+	int r = sk.Recv(&c, 1, MSG_PEEK | MSG_DONTWAIT);
+	return r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+// one thread per destination being filled, so a destination whose
+// connects hang until the SYN retries give up holds up no other one
+static void FillDest(uint64_t id)
+{
+	SockAddrIn dst(static_cast<uint32_t>(id >> 16), static_cast<uint16_t>(id & 0xffff));
+	std::unique_lock<std::mutex> lock(g_mutex);
+	while (g_dests[id].idle.size() < g_per_dest) {
+		lock.unlock();
+		auto sk = Egress::Connect(dst, g_opts);
+		int err = errno;
+		lock.lock();
+		Dest& d = g_dests[id];
+		if (!sk) {
+			errno = err;
+			PLOG(WARNING) << "preconnect to " << dst.to_str();
+			d.retry_at = ::time(nullptr) + kRetrySecs;
+			break;
+		}
+		++g_made;
+		d.idle.emplace_back(std::move(sk), ::time(nullptr));
+	}
+	g_dests[id].filling = false;
+}
+
+static void RefillLoop()
+{
+	time_t last_decay = ::time(nullptr);
+	std::unique_lock<std::mutex> lock(g_mutex);
+	while (true) {
+		g_cond.wait_for(lock, std::chrono::seconds(1));
+		time_t now = ::time(nullptr);
+		bool decay = last_decay + kDecaySecs <= now;
+		if (decay)
+			last_decay = now;
+		// expire, decay and rank
+		std::vector<std::shared_ptr<TcpSocket>> closing;
+		std::vector<std::pair<double, uint64_t>> hot;
+		for (auto it = g_dests.begin(); it != g_dests.end(); ) {
+			Dest& d = it->second;
+			while (!d.idle.empty() && d.idle.front().second + g_idle_secs <= now) {
+				closing.push_back(std::move(d.idle.front().first));
+				d.idle.pop_front();
+				++g_expired;
+			}
+			if (decay)
+				d.hits /= 2;
+			if (d.hits < 0.1 && d.idle.empty() && !d.filling) {
+				it = g_dests.erase(it);
+				continue;
+			}
+			if (d.hits >= kHotHits && d.retry_at <= now)
+				hot.emplace_back(d.hits, it->first);
+			++it;
+		}
+		std::sort(hot.begin(), hot.end(), std::greater<std::pair<double, uint64_t>>());
+		if (hot.size() > g_max_dests)
+			hot.resize(g_max_dests);
+		for (auto& h : hot) {
+			Dest& d = g_dests[h.second];
+			if (d.filling || d.idle.size() >= g_per_dest)
+				continue;
+			d.filling = true;
+			std::thread(FillDest, h.second).detach();
+		}
+		// sockets close outside the lock
+		lock.unlock();
+		closing.clear();
+		lock.lock();
+	}
+}
+
+std::shared_ptr<TcpSocket> PreConnect::Take(const SockAddrIn& dst)
+{
+	if (g_per_dest == 0)
+		return nullptr;
+	std::call_once(g_started, [] {
+		std::thread(RefillLoop).detach();
+	});
+	std::shared_ptr<TcpSocket> sk;
+	{
+		std::lock_guard<std::mutex> lock(g_mutex);
+		Dest& d = g_dests[DestId(dst)];
+		d.hits += 1;
+		time_t now = ::time(nullptr);
+		while (!sk && !d.idle.empty()) {
+			auto entry = std::move(d.idle.front());
+			d.idle.pop_front();
+			if (entry.second + g_idle_secs > now && !PeerClosed(*entry.first))
+				sk = std::move(entry.first);
+			else
+				++g_expired;
+		}
+	}
+	// refill what was taken, or start on a destination turning hot
+	g_cond.notify_one();
+	++(sk ? g_hits : g_misses);
+	return sk;
+}
+
+std::string PreConnect::StatsString()
+{
+	char buf[160];
+	snprintf(buf, sizeof(buf), "preconnect hits:%llu misses:%llu made:%llu expired:%llu",
+			static_cast<unsigned long long>(g_hits.load()),
+			static_cast<unsigned long long>(g_misses.load()),
+			static_cast<unsigned long long>(g_made.load()),
+			static_cast<unsigned long long>(g_expired.load()));
+	return buf;
+}
+
+CFW_NS_END
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include "socket.h"
+
+CFW_NS_BEGIN
+
+// Idle upstream connections, made ahead of time to the destinations a
+// tunnel process connects to most. Every CONNECT counts a hit on its
+// destination, hits decay by half every 10s, and the busiest ones keep
+// a few connections ready so the CONNECT skips the handshake. A pooled
+// connection is handed out once and closed if not taken soon.
+class PreConnect
+{
+public:
+	// per_dest: connections kept per hot destination, 0 to disable
+	static void Configure(size_t per_dest, size_t max_dests, std::chrono::seconds idle,
+			const SockOpts& opts);
+	// a pooled connection to dst or nullptr; the first call in a process
+	// starts the thread ranking destinations, each hot one is refilled
+	// by a thread of its own
+	static std::shared_ptr<TcpSocket> Take(const SockAddrIn& dst);
+	static std::string StatsString();
+};
+
+CFW_NS_END
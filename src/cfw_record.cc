@@ -0,0 +1,115 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <cstring>
+#include <glog/logging.h>
+#include "cfw_record.h"
+
+CFW_NS_BEGIN
+
+static const size_t kFlushLen = 65536;
+
+int FrameRecorder::fd_ = -1;
+static bool g_payload = false;
+static thread_local Bytes t_buf;
+
+bool FrameRecorder::Open(const std::string& path, bool payload)
+{
+	int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0) {
+		PLOG(ERROR) << "open record file " << path;
+		return false;
+	}
+	struct stat st;
+	if (::fstat(fd, &st) < 0 || (st.st_size == 0 &&
+			::write(fd, kRecordMagic, sizeof(kRecordMagic)) != sizeof(kRecordMagic))) {
+		PLOG(ERROR) << "init record file " << path;
+		::close(fd);
+		return false;
+	}
+	g_payload = payload;
+	fd_ = fd;
+	return true;
+}
+
+void FrameRecorder::DoFrame(FrameDir dir, const Pkg& pkg, uint32_t tunnel)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	FrameRecord rec;
+	rec.ts_ns = static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+	rec.key = pkg.key;
+	rec.tunnel = tunnel;
+	rec.dir = static_cast<uint8_t>(dir);
+	rec.cmd = static_cast<uint8_t>(pkg.cmd);
+	rec.flags = pkg.flags;
+	rec.has_data = g_payload;
+	rec.len = static_cast<uint32_t>(pkg.data.size());
+	t_buf.append(reinterpret_cast<const uint8_t*>(&rec), sizeof(rec));
+	if (g_payload)
+		t_buf.append(pkg.data);
+	if (t_buf.size() >= kFlushLen)
+		Flush();
+}
+
+void FrameRecorder::Flush()
+{
+	if (fd_ < 0 || t_buf.empty())
+		return;
+	ssize_t r = ::write(fd_, t_buf.data(), t_buf.size());
+	PLOG_IF(ERROR, r != static_cast<ssize_t>(t_buf.size())) << "write record file";
+	t_buf.clear();
+}
+
+FrameTrace::~FrameTrace()
+{
+	if (base_)
+		::munmap(const_cast<uint8_t*>(base_), size_);
+}
+
+bool FrameTrace::Open(const std::string& path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		PLOG(ERROR) << "open trace " << path;
+		return false;
+	}
+	struct stat st;
+	if (::fstat(fd, &st) < 0 || st.st_size < static_cast<off_t>(sizeof(kRecordMagic))) {
+		LOG(ERROR) << "bad trace " << path;
+		::close(fd);
+		return false;
+	}
+	void* p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (p == MAP_FAILED) {
+		PLOG(ERROR) << "mmap trace " << path;
+		return false;
+	}
+	base_ = static_cast<const uint8_t*>(p);
+	size_ = st.st_size;
+	if (std::memcmp(base_, kRecordMagic, sizeof(kRecordMagic)) != 0) {
+		LOG(ERROR) << "bad trace magic " << path;
+		return false;
+	}
+	::madvise(p, size_, MADV_SEQUENTIAL);
+	pos_ = sizeof(kRecordMagic);
+	return true;
+}
+
+const FrameRecord* FrameTrace::Next(const uint8_t** data)
+{
+	if (size_ - pos_ < sizeof(FrameRecord))
+		return nullptr;
+	auto rec = reinterpret_cast<const FrameRecord*>(base_ + pos_);
+	size_t data_len = rec->has_data ? rec->len : 0;
+	if (size_ - pos_ - sizeof(FrameRecord) < data_len)
+		return nullptr;
+	*data = (rec->has_data ? base_ + pos_ + sizeof(FrameRecord) : nullptr);
+	pos_ += sizeof(FrameRecord) + data_len;
+	return rec;
+}
+
+CFW_NS_END
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+#include "cfw.h"
+
+CFW_NS_BEGIN
+
+// Trace file: "CFWREC02" then FrameRecords, each followed by len bytes
+// of payload if has_data. Payloads are decrypted but stay compressed
+// when flags has kPkgFlagLz.
+const char kRecordMagic[8] = {'C', 'F', 'W', 'R', 'E', 'C', '0', '2'};
+
+enum class FrameDir : uint8_t
+{
+	kIn = 0,	// read from the tunnel
+	kOut = 1	// sent to the tunnel
+};
+
+#pragma pack(1)
+struct FrameRecord
+{
+	uint64_t ts_ns;		// CLOCK_MONOTONIC
+	uint64_t key;
+	// the tunnel the frame crossed: the tunnel process pid on the
+	// server, a connection sequence number on the client
+	uint32_t tunnel;
+	uint8_t dir;
+	uint8_t cmd;
+	uint8_t flags;
+	uint8_t has_data;
+	uint32_t len;
+};
+#pragma pack()
+
+// Appends the frames crossing the tunnel to a trace file. Records are
+// buffered per thread and written with one O_APPEND write per Flush(),
+// so the forked server processes can share the file. What a thread has
+// not flushed when it exits is lost, the tunnel loops flush on the way out.
+class FrameRecorder
+{
+public:
+	static bool Open(const std::string& path, bool payload);
+	static void Frame(FrameDir dir, const Pkg& pkg, uint32_t tunnel) {
+		if (fd_ >= 0)
+			DoFrame(dir, pkg, tunnel);
+	}
+	static void Flush();
+private:
+	static void DoFrame(FrameDir dir, const Pkg& pkg, uint32_t tunnel);
+	static int fd_;
+};
+
+// Read side, maps the whole trace
+class FrameTrace
+{
+public:
+	FrameTrace() = default;
+	FrameTrace(const FrameTrace&) = delete;
+	FrameTrace& operator=(const FrameTrace&) = delete;
+	~FrameTrace();
+	bool Open(const std::string& path);
+	// ret nullptr at the end or on a truncated record, *data is set to
+	// the payload or nullptr
+	const FrameRecord* Next(const uint8_t** data);
+private:
+	const uint8_t* base_ = nullptr;
+	size_t size_ = 0;
+	size_t pos_ = 0;
+};
+
+CFW_NS_END
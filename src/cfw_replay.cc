@@ -0,0 +1,239 @@
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include "socket.h"
+#include "cfw_crypt.h"
+#include "cfw_compress.h"
+#include "cfw_record.h"
+
+using namespace cfw;
+
+// Replays a trace written with --record_file. Every stream is pointed
+// at --sink (a discard server), so only the frame sizes, timing and
+// interleaving of the recorded traffic are reproduced.
+DEFINE_string(trace, "", "trace file written with --record_file");
+DEFINE_string(mode, "server", "drive a cfw_server over a tunnel or a cfw_client over SOCKS5: server|client");
+DEFINE_string(target, "127.0.0.1:12322", "cfw_server tunnel address or cfw_client SOCKS address");
+DEFINE_string(sink, "127.0.0.1:9", "ip:port every replayed stream connects to");
+DEFINE_string(dir, "out", "replay the frames the recording side sent (out) or read (in)");
+DEFINE_double(speed, 1.0, "time scale, 2 replays twice as fast, 0 as fast as possible");
+DEFINE_uint64(linger_ms, 1000, "keep the tunnel until it is idle this long after the last frame");
+
+static bool ParseAddr(const std::string& str, SockAddrIn* addr)
+{
+	size_t colon = str.rfind(':');
+	if (colon == std::string::npos)
+		return false;
+	*addr = SockAddrIn(str.substr(0, colon), std::stoi(str.substr(colon + 1)));
+	return true;
+}
+
+struct ReplayStats
+{
+	uint64_t frames = 0;
+	uint64_t bytes = 0;
+	uint64_t streams = 0;
+	uint64_t failed = 0;
+	uint64_t late = 0;
+	uint64_t recv_frames = 0;
+};
+
+// sleeps until the recorded offset of each frame, scaled by --speed
+class Pacer
+{
+public:
+	explicit Pacer(ReplayStats* stats) : stats_(stats) {}
+	void Wait(uint64_t ts_ns) {
+		auto now = std::chrono::steady_clock::now();
+		if (!started_) {
+			started_ = true;
+			base_ts_ = ts_ns;
+			start_ = now;
+		}
+		if (FLAGS_speed <= 0 || ts_ns < base_ts_)
+			return;
+		auto due = start_ + std::chrono::nanoseconds(
+				static_cast<int64_t>((ts_ns - base_ts_) / FLAGS_speed));
+		if (due > now)
+			std::this_thread::sleep_until(due);
+		else if (now - due > std::chrono::milliseconds(1))
+			++stats_->late;
+	}
+private:
+	ReplayStats* stats_;
+	bool started_ = false;
+	uint64_t base_ts_ = 0;
+	std::chrono::steady_clock::time_point start_;
+};
+
+// recorded payload, or zeros of the recorded length without one
+static void FillData(const FrameRecord& rec, const uint8_t* data, Pkg* pkg)
+{
+	if (data) {
+		pkg->data.assign(data, rec.len);
+		pkg->flags = rec.flags;
+	} else {
+		pkg->data.assign(rec.len, 0);
+	}
+}
+
+// a tunnel to the server for each tunnel in the trace
+struct ReplayTunnel
+{
+	ReplayTunnel() : reader(sk, dec) {}
+	TcpSocket sk;
+	Crypt enc, dec;
+	PkgReader reader;
+};
+
+static bool ReplayServer(FrameTrace* trace, uint8_t dir, const SockAddrIn& target,
+		const SockAddrIn& sink, ReplayStats* stats)
+{
+	std::map<uint32_t, std::unique_ptr<ReplayTunnel>> tunnels;
+	// kConn with early data: ATYP(1) ip port, see ProcEarlyRequest
+	uint8_t conn[7] = {1};
+	uint32_t ip = htonl(sink.ip());
+	uint16_t port = htons(sink.port());
+	std::memcpy(conn + 1, &ip, sizeof(ip));
+	std::memcpy(conn + 5, &port, sizeof(port));
+
+	Pacer pacer(stats);
+	const FrameRecord* rec;
+	const uint8_t* data;
+	while ((rec = trace->Next(&data))) {
+		Cmd cmd = static_cast<Cmd>(rec->cmd);
+		if (rec->dir != dir || cmd == Cmd::kProbe)
+			continue;
+		pacer.Wait(rec->ts_ns);
+		auto& tun = tunnels[rec->tunnel];
+		if (!tun) {
+			tun.reset(new ReplayTunnel);
+			if (!tun->sk.Connect(target)) {
+				PLOG(ERROR) << "connect " << target.to_str();
+				return false;
+			}
+		}
+		Pkg pkg(rec->key, cmd);
+		if (cmd == Cmd::kConn) {
+			pkg.data.assign(conn, sizeof(conn));
+			++stats->streams;
+		} else if (cmd == Cmd::kData) {
+			FillData(*rec, data, &pkg);
+		}
+		if (!SendPkg(tun->sk, tun->enc, pkg)) {
+			PLOG(ERROR) << "tunnel send error";
+			return false;
+		}
+		++stats->frames;
+		stats->bytes += pkg.data.size();
+		Pkg in;
+		int r;
+		while ((r = tun->reader.Read(&in, std::chrono::milliseconds(0))) == 0)
+			++stats->recv_frames;
+		if (r < 0) {
+			PLOG(ERROR) << "tunnel recv error";
+			return false;
+		}
+	}
+	// the server drops the streams with the tunnel, give them time to finish
+	for (auto& it : tunnels) {
+		Pkg in;
+		while (it.second->reader.Read(&in, std::chrono::milliseconds(FLAGS_linger_ms)) == 0)
+			++stats->recv_frames;
+	}
+	return true;
+}
+
+static bool SocksConnect(TcpSocket* sk, const SockAddrIn& target, const SockAddrIn& sink)
+{
+	uint8_t rsp[10];
+	uint8_t req[10] = {5, 1, 0, 1};
+	uint32_t ip = htonl(sink.ip());
+	uint16_t port = htons(sink.port());
+	std::memcpy(req + 4, &ip, sizeof(ip));
+	std::memcpy(req + 8, &port, sizeof(port));
+	const uint8_t greeting[3] = {5, 1, 0};
+	return sk->Connect(target) &&
+		sk->SetRecvTimeout(std::chrono::seconds(10)) &&
+		sk->SendN(greeting, sizeof(greeting)) && sk->RecvN(rsp, 2) && rsp[1] == 0 &&
+		sk->SendN(req, sizeof(req)) && sk->RecvN(rsp, sizeof(rsp)) && rsp[1] == 0;
+}
+
+static bool ReplayClient(FrameTrace* trace, uint8_t dir, const SockAddrIn& target,
+		const SockAddrIn& sink, ReplayStats* stats)
+{
+	// by tunnel and key, keys of different tunnels may clash
+	std::map<std::pair<uint32_t, Key>, std::unique_ptr<TcpSocket>> streams;
+	Pacer pacer(stats);
+	const FrameRecord* rec;
+	const uint8_t* data;
+	while ((rec = trace->Next(&data))) {
+		Cmd cmd = static_cast<Cmd>(rec->cmd);
+		if (rec->dir != dir || cmd == Cmd::kProbe)
+			continue;
+		pacer.Wait(rec->ts_ns);
+		auto id = std::make_pair(rec->tunnel, rec->key);
+		if (cmd == Cmd::kConn) {
+			std::unique_ptr<TcpSocket> sk(new TcpSocket);
+			++stats->streams;
+			if (SocksConnect(sk.get(), target, sink)) {
+				streams[id] = std::move(sk);
+			} else {
+				PLOG(ERROR) << "key:" << rec->key << " socks connect failed";
+				++stats->failed;
+			}
+		} else if (cmd == Cmd::kData) {
+			auto it = streams.find(id);
+			if (it == streams.end())
+				continue;
+			Pkg pkg(rec->key, cmd);
+			FillData(*rec, data, &pkg);
+			if (!Decompress(&pkg) || !it->second->SendN(pkg.data.data(), pkg.data.size())) {
+				LOG(ERROR) << "key:" << rec->key << " send failed";
+				streams.erase(it);
+				++stats->failed;
+				continue;
+			}
+			++stats->frames;
+			stats->bytes += pkg.data.size();
+		} else if (cmd == Cmd::kClose) {
+			streams.erase(id);
+		}
+	}
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	google::ParseCommandLineFlags(&argc, &argv, true);
+	google::InitGoogleLogging(argv[0]);
+	FLAGS_logtostderr = true;
+	SockAddrIn target, sink;
+	CHECK(ParseAddr(FLAGS_target, &target)) << "bad --target:" << FLAGS_target;
+	CHECK(ParseAddr(FLAGS_sink, &sink)) << "bad --sink:" << FLAGS_sink;
+	CHECK(FLAGS_dir == "out" || FLAGS_dir == "in") << "bad --dir:" << FLAGS_dir;
+	uint8_t dir = static_cast<uint8_t>(FLAGS_dir == "out" ? FrameDir::kOut : FrameDir::kIn);
+	FrameTrace trace;
+	CHECK(trace.Open(FLAGS_trace)) << "bad --trace:" << FLAGS_trace;
+
+	ReplayStats stats;
+	auto start = std::chrono::steady_clock::now();
+	bool ok = false;
+	if (FLAGS_mode == "server")
+		ok = ReplayServer(&trace, dir, target, sink, &stats);
+	else if (FLAGS_mode == "client")
+		ok = ReplayClient(&trace, dir, target, sink, &stats);
+	else
+		LOG(FATAL) << "bad --mode:" << FLAGS_mode;
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	LOG(INFO) << "replay " << (ok ? "done" : "aborted") << " in " << secs << "s"
+		<< " streams:" << stats.streams << " failed:" << stats.failed
+		<< " frames:" << stats.frames << " bytes:" << stats.bytes
+		<< " late:" << stats.late << " recv_frames:" << stats.recv_frames
+		<< " MB/s:" << (secs > 0 ? stats.bytes / secs / 1e6 : 0);
+	return ok ? 0 : 1;
+}
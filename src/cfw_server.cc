@@ -1,302 +1,102 @@
 #include <signal.h>
+#include <poll.h>
 #include <netdb.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <cstring>
 #include <string>
 #include <thread>
-#include <queue>
-#include <array>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include "socket.h"
-#include "cfw_channel.h"
-#include "cfw_crypt.h"
+#include "io_engine.h"
+#include "cfw_compress.h"
+#include "cfw_trace.h"
+#include "cfw_budget.h"
+#include "cfw_record.h"
+#include "cfw_egress.h"
+#include "cfw_handoff.h"
+#include "cfw_shaper.h"
+#include "cfw_preconnect.h"
+#include "cfw_server_io.h"
 
 using namespace cfw;
 
 DEFINE_string(server, "127.0.0.1", "server IP");
 DEFINE_uint64(server_port, 12322, "bind server port");
-
-static Channel<Pkg> g_channel;
-
-class ClientDataIo
-{
-public:
-	ClientDataIo(Key k) : key_(k) {}
-	ClientDataIo(const ClientDataIo&) = delete;
-	ClientDataIo& operator=(const ClientDataIo&) = delete;
-	// block read
-	bool ReadN(uint8_t* buf, size_t len) {
-		size_t wpos = 0;
-		while (wpos < len) {
-			while (!pkg_ || read_pos_ >= pkg_->data.size()) {
-				int r = ReadPkg();
-				if (r > 0)
-					std::this_thread::sleep_for(std::chrono::milliseconds(50));
-				else if (r < 0)
-					return false;
-			}
-			size_t need = len - wpos;
-		   	size_t left = pkg_->data.length() - read_pos_;
-			size_t copy_len = (need <= left ? need : left);
-			std::memcpy(buf + wpos, pkg_->data.data() + read_pos_, copy_len);
-			wpos += copy_len;
-			read_pos_ += copy_len;
-		}
-		return true;
-	}
-	template <class T>
-	bool ReadValue(T* val) {
-		return ReadN(reinterpret_cast<uint8_t*>(val), sizeof(T));
-	}
-	// non-block read
-	// ret 0:OK 1:EMPTY -1:ERROR
-	int ReadData(Bytes* buf) {
-		if (!pkg_ || read_pos_ >= pkg_->data.size()) {
-			int r = ReadPkg();
-			if (r != 0) return r;
-		}
-		if (read_pos_ == 0) {
-			*buf = pkg_->data;
-		} else {
-			buf->assign(pkg_->data, read_pos_, Bytes::npos);
-		}
-		pkg_.reset();
-		read_pos_ = 0;
-		return 0;
-	}
-	void WriteN(const uint8_t* buf, size_t len) {
-		g_channel.Push(0, std::make_shared<Pkg>(key_, Cmd::kData, buf, len));
-   	}
-	void WriteClose() {
-		g_channel.Push(0, std::make_shared<Pkg>(key_, Cmd::kClose));
-	}
-	Key key() const {
-		return key_;
-	}
-protected:
-	int ReadPkg() {
-		auto pkg = g_channel.Pop(key_);
-		if (!pkg)
-			return 1;
-		else if (pkg->cmd != Cmd::kData) {
-			if (pkg->cmd == Cmd::kClose)
-				LOG(INFO) << "thread:" << key() << " channel recv kClose!";
-			else
-				LOG(ERROR) << "thread:" << key()
-					<< " channel recv bad cmd:" << static_cast<unsigned>(pkg->cmd);
-			return -1;
-		}
-		pkg_ = std::move(pkg);
-		read_pos_ = 0;
-		return 0;
-	}
-private:
-	Key key_;
-	std::shared_ptr<Pkg> pkg_;
-	size_t read_pos_;
-};
-
-static bool ProcHandshake(ClientDataIo* io)
-{
-	uint8_t ver, meth_count;
-	if (!io->ReadValue(&ver)) return false;
-	LOG(INFO) << "thread:" << io->key()
-		<< " handshake req ver:" << static_cast<unsigned>(ver);
-	if (!io->ReadValue(&meth_count)) return false;
-	LOG(INFO) << "thread:" << io->key()
-		<< " handshake req method count:" << static_cast<unsigned>(meth_count);
-	for (uint8_t i = 0; i < meth_count; ++i) {
-		uint8_t meth;
-		if (!io->ReadValue(&meth)) return false;
-		LOG(INFO) << "thread:" << io->key()
-			<< " handshake req method:" << static_cast<unsigned>(meth);
-	}
-	Buffer buf;
-	buf[0] = ver;
-	buf[1] = 0;
-	io->WriteN(buf.data(), 2);
-	return true;
-}
-
-static bool ResolveIp(const char* url, uint32_t* net_order_ip)
+DEFINE_string(listen_unix, "", "accept tunnels on this UNIX socket path instead of --server_port");
+DEFINE_bool(compress, false, "compress data sent over the tunnel when it pays off");
+DEFINE_bool(io_uring, false, "use io_uring for socket I/O if the kernel supports it");
+DEFINE_string(record_file, "", "append the frames crossing the tunnel to this trace file");
+DEFINE_bool(record_payload, false, "record frame payloads too, not only their length");
+DEFINE_bool(trace, false, "trace pkgs through the pipeline stages and log latency histograms");
+DEFINE_string(trace_file, "", "ring file for sampled pkg traces with --trace");
+DEFINE_uint64(trace_sample, 1024, "dump 1 of this many pkg traces to --trace_file");
+DEFINE_uint64(mem_budget_mb, 0, "refuse new streams and pause the heaviest ones when queued pkgs"
+		" of all tunnels hold more than this, 0 for no limit");
+DEFINE_uint64(max_streams, 0, "refuse new streams beyond this many over all tunnels, 0 for no limit");
+DEFINE_string(tunnel_sockopts, "default", "tunnel listener socket profile: default|latency|throughput,"
+		" fast open needs net.ipv4.tcp_fastopen on both hosts");
+DEFINE_string(upstream_sockopts, "default", "upstream socket profile: default|latency|throughput");
+DEFINE_uint64(direct_port, 0, "also accept plaintext one-stream connections (cfw_client --direct_port)"
+		" on this port, relayed with splice(); only for trusted links, 0 to disable");
+DEFINE_string(handoff_path, "", "UNIX socket to take the listener of a running server from and to"
+		" hand it to the next one on; tunnel processes of the old server keep running");
+DEFINE_string(egress_ips, "", "a,b,... local addresses to connect upstream from, round robin"
+		" per destination, each adding a full ephemeral port range");
+DEFINE_uint64(preconnect, 0, "idle upstream connections to keep ready per hot destination"
+		" of a tunnel, 0 to disable");
+DEFINE_uint64(preconnect_dests, 8, "hot destinations per tunnel to keep connections for");
+DEFINE_uint64(preconnect_idle_secs, 10, "close pooled upstream connections not taken by then");
+DEFINE_uint64(tunnel_timeout_ms, 10000, "drop a tunnel nothing arrived on for this long,"
+		" keep it above the --probe_ms of cfw_client");
+DEFINE_string(shaping_file, "", "per client/destination rate limits, reloaded when the file changes;"
+		" lines of: client ADDR[/BITS] KB/s [BURST_KB] or dest ADDR[/BITS][:PORT] KB/s [BURST_KB]");
+
+static ServerOptions g_opts;
+
+// a direct connection: kDirectMagic ATYP DST.ADDR DST.PORT, then the
+// stream itself; the client already answered SOCKS, failures just close
+static void ProcessDirectConnection(TcpSocket csk)
 {
-	char buf[1024];
-	struct hostent entry, *result;
-	int error;
-	int r = ::gethostbyname_r(url, &entry, buf, sizeof(buf), &result, &error);
-	if (r) {
-		LOG(ERROR) << "gethostbyname ret:" << r << " h_errno:" << error;
-		return false;
-	} else if (!result) {
-		LOG(ERROR) << "gethostbyname resolve nothing";
-		return false;
-	}
-	struct in_addr* ia = reinterpret_cast<struct in_addr*>(entry.h_addr_list[0]);
-	*net_order_ip = ia->s_addr;
-	return true;
-}
-
-static bool SendCommandResp(ClientDataIo* io, uint8_t reply, const SockAddrIn* bind = nullptr)
-{
-	Buffer rsp_buf;
-	rsp_buf[0] = 5;
-	rsp_buf[1] = reply;
-	rsp_buf[2] = 0;
-	rsp_buf[3] = 1;
-	if (bind) {
-		*reinterpret_cast<uint32_t*>(&rsp_buf[4]) = bind->ip();
-		*reinterpret_cast<uint16_t*>(&rsp_buf[8]) = bind->port();
-	} else {
-		std::memset(&rsp_buf[4], 0, 6);
-	}
-	LOG(INFO) << "thread:" << io->key()
-		<< " SendCommandResp {reply:" << static_cast<unsigned>(reply)
-		<< " bind:" << (bind ? bind->to_str() : "0") << "}";
-	io->WriteN(rsp_buf.data(), 10);
-	return true;
-}
-
-static bool ProcCommand(ClientDataIo* io, std::shared_ptr<TcpSocket>* sk)
-{
-	uint8_t ver, cmd, rsv, atyp;
+	uint8_t magic[sizeof(kDirectMagic)];
+	uint8_t atyp, len;
 	uint32_t net_order_ip;
 	uint16_t net_order_port;
-
-	if ((!io->ReadValue(&ver)) ||
-			(!io->ReadValue(&cmd)) ||
-			(!io->ReadValue(&rsv)) ||
-			(!io->ReadValue(&atyp))) {
-		LOG(ERROR) << "thread:" << io->key() << " proc command read error";
-		return false;
-	}
-	LOG(INFO) << "thread:" << io->key()
-		<< " proc command ver:" << static_cast<unsigned>(ver)
-		<< " cmd:" << static_cast<unsigned>(cmd)
-		<< " rsv:" << static_cast<unsigned>(rsv)
-		<< " atyp:" << static_cast<unsigned>(atyp);
-	if (cmd != 1) {
-		LOG(ERROR) << "thread:" << io->key() << " proc command unsurport cmd";
-		SendCommandResp(io, 1);
-		return false;
-	} else if (rsv != 0) {
-		LOG(ERROR) << "thread:" << io->key() << " proc command bad rsv:" << rsv;
-		return false;
+	char url[256];
+	csk.SetRecvTimeout(std::chrono::seconds(10));
+	if (!csk.RecvN(magic, sizeof(magic)) || std::memcmp(magic, kDirectMagic, sizeof(magic)) != 0 ||
+			!csk.RecvValue(&atyp)) {
+		LOG(ERROR) << "bad direct header";
+		return;
 	}
-
 	if (atyp == 1) { // ip (v4)
-		if (!io->ReadValue(&net_order_ip)) {
-			LOG(ERROR) << "thread:" << io->key() << " proc command read ip error";
-			return false;
-		}
+		if (!csk.RecvValue(&net_order_ip))
+			return;
 	} else if (atyp == 3) { // url
-		uint8_t len;
-		char url[257];
-		if ((!io->ReadValue(&len)) ||
-				(!io->ReadN(reinterpret_cast<uint8_t*>(url), len))) {
-			LOG(ERROR) << "thread:" << io->key() << " proc command read url error";
-			return false;
-		}
+		if (!csk.RecvValue(&len) || !csk.RecvN(url, len))
+			return;
 		url[len] = 0;
-		LOG(INFO) << "thread:" << io->key() << " request url: " << url;
 		if (!ResolveIp(url, &net_order_ip)) {
-			LOG(ERROR) << "thread:" << io->key() << "resolve ip error";
-			SendCommandResp(io, 1);
-			return false;
+			LOG(ERROR) << "direct resolve ip error:" << url;
+			return;
 		}
 	} else {
-		LOG(ERROR) << "thread:" << io->key() << " proc command unsurport atyp";
-		SendCommandResp(io, 1);
-		return false;
-	}
-
-	if (!io->ReadValue(&net_order_port)) {
-		LOG(ERROR) << "thread:" << io->key() << " proc command read port error";
-		return false;
-	}
-
-	SockAddrIn req_addr{ntohl(net_order_ip), ntohs(net_order_port)};
-	LOG(INFO) << "thread:" << io->key() << " request connect to "<< req_addr.to_str();
-	*sk = std::make_shared<TcpSocket>();
-	if (!(*sk)->Connect(req_addr)) {
-		LOG(ERROR) << "thread:" << io->key() << " connect remote server error";
-		SendCommandResp(io, 1);
-	}
-	SockAddrIn bind_addr;
-	PCHECK((*sk)->GetSockAddr(&bind_addr)) << "GetSockAddr";
-	return SendCommandResp(io, 0, &bind_addr);
-}
-
-static void HandleClient(Key key)
-{
-	if (!g_channel.Own(key)) {
-		LOG(FATAL) << "client key conflicts";
-	}
-	LOG(INFO) << "thread:" << key << " start";
-	ClientDataIo io{key};
-
-	if (!ProcHandshake(&io)) {
-		LOG(ERROR) << "thread:" << key << " proc handshake error";
+		LOG(ERROR) << "direct unsupported atyp:" << static_cast<unsigned>(atyp);
 		return;
 	}
-	LOG(INFO) << "thread:" << key << " handshake ok";
-
-	std::shared_ptr<TcpSocket> sk;
-	if (!ProcCommand(&io, &sk)) {
-		LOG(ERROR) << "thread:" << key << " proc command error";
+	if (!csk.RecvValue(&net_order_port))
+		return;
+	SockAddrIn addr{ntohl(net_order_ip), ntohs(net_order_port)};
+	LOG(INFO) << "direct connect to " << addr.to_str();
+	auto sk = Egress::Connect(addr, g_opts.upstream_opts);
+	if (!sk) {
+		PLOG(ERROR) << "direct connect remote server error";
 		return;
 	}
-	LOG(INFO) << "thread:" << key << " connect command ok";
-
-	Buffer buf;
-	time_t last_active = ::time(nullptr);
-	// wait 50ms for data incoming, CAN'T use RecvN
-	PCHECK(sk->SetRecvTimeout(std::chrono::milliseconds(50)));
-	while (true) {
-		int len = sk->Recv(buf.data(), sizeof(buf));
-		if (len > 0) {
-			LOG(INFO) << "thread:" << key << " socket recv pkg [" << len << "]";
-			io.WriteN(buf.data(), len);
-			last_active = ::time(nullptr);
-		} else if (len < 0 && errno == EAGAIN) {
-			VLOG(1) << "thread:" << key << " socket recv timeout";
-		} else {
-			if (len == 0)
-				LOG(INFO) << "thread:" << key << " socket closed by peer";
-			else 
-				PLOG(INFO) << "thread:" << key << " socket recv error";
-			io.WriteClose();
-			goto exit;
-		}
-
-		while (true) {
-			Bytes data;
-			int r = io.ReadData(&data);
-			if (r < 0) {
-				LOG(INFO) << "thread:" << key << " channel read failed";
-				goto exit;
-			} else if (r > 0) {
-				VLOG(1) << "thread:" << key << " channel empty";
-				break; // go on reading socket
-			}
-			LOG(INFO) << "thread:" << key << " channel read data [" << data.size() << "]";
-			last_active = ::time(nullptr);
-			if (!sk->SendValue(data)) {
-				PLOG(ERROR) << "thread:" << key << " socket SendValue error";
-				io.WriteClose();
-				goto exit;
-			}
-		}
-
-		if (last_active + 600 < ::time(nullptr)) {
-			LOG(ERROR) << "thread:" << key << " is dead";
-			goto exit;
-		}
-	};
-exit:
-	g_channel.Free(key);
-	LOG(INFO) << "thread:" << key << " exit";
+	bool ok = TcpSocket::Splice(csk, *sk, std::chrono::seconds(600));
+	PLOG_IF(INFO, !ok) << "direct relay error";
+	LOG(INFO) << "direct connection done, " << IoEngine::StatsString();
 }
 
 static void ProcessIoConnection(TcpSocket sk)
@@ -304,70 +104,102 @@ static void ProcessIoConnection(TcpSocket sk)
 	LOG(INFO) << "new process start";
 	SockAddrIn client_addr;
 	sk.GetPeerAddr(&client_addr);
-	// wait 10min for expected data
-	sk.SetRecvTimeout(std::chrono::minutes(10));
-	time_t last_gc = ::time(nullptr);
-	Crypt enc, dec;
-
-	while (true) {
-		// get PKG from IO connection
-		auto new_pkg = std::make_shared<Pkg>();
-		// wait 50ms for pkg incoming
-		int r = RecvPkg(sk, dec, new_pkg.get(), std::chrono::milliseconds(50));
-		if (r < 0) {
-			PLOG(INFO) << "io socket recv error";
-			break;
-		} else if (r == 0) {
-			if (new_pkg->cmd == Cmd::kConn) {
-				LOG(INFO) << "io socket recv kConn pkg key:" << new_pkg->key;
-				// create thread if kConn command
-				std::thread(HandleClient, new_pkg->key).detach();
-			} else {
-				LOG(INFO) << "io socket recv pkg {key:" << new_pkg->key
-					<< " cmd:" << static_cast<unsigned>(new_pkg->cmd)
-					<< " len:" << new_pkg->data.size() << "}";
-				// forward pkg
-				g_channel.Push(new_pkg->key, new_pkg);
-			}
-		}
-
-		while (true) {
-			auto pkg = g_channel.Pop(0);
-			if (!pkg) {
-				VLOG(1) << "io channel empty";
-				break;
-			}
-			LOG(INFO) << "io channel recv pkg {key:" << pkg->key
-				<< " cmd:" << static_cast<unsigned>(pkg->cmd)
-				<< " len:" << pkg->data.size() << "}";
-			bool ret = SendPkg(sk, enc, *pkg);
-			PLOG_IF(ERROR, !ret) << "io socket send pkg error";
-		}
-
-		time_t now = ::time(nullptr);
-		if (last_gc + 60 < now)
-			g_channel.GarbageCleanup(120);
-	}
+	// tells the tunnels apart in --record_file
+	ServeTunnel(sk, client_addr, static_cast<uint32_t>(::getpid()));
 	LOG(INFO) << "process exit";
 }
 
+// wait up to 1s for a connection on a or b (if set) with plain accept()
+static TcpSocket AcceptEither(TcpServerSocket* a, TcpServerSocket* b, bool* from_b)
+{
+	pollfd pfds[2] = {{a->sock(), POLLIN, 0}, {b ? b->sock() : -1, POLLIN, 0}};
+	int r = ::poll(pfds, 2, 1000);
+	if (r <= 0) {
+		if (r == 0)
+			errno = EAGAIN;
+		return TcpSocket(-1);
+	}
+	*from_b = !(pfds[0].revents & POLLIN);
+	return (*from_b ? b : a)->TryAccept(std::chrono::milliseconds(0));
+}
+
 int main(int argc, char* argv[])
 {
 	google::ParseCommandLineFlags(&argc, &argv, true);
 	google::InitGoogleLogging(argv[0]);
 	FLAGS_logbufsecs = 0;
+	IoEngine::UseUring(FLAGS_io_uring);
+	SockOpts tunnel_opts;
+	CHECK(SockOpts::Profile(FLAGS_tunnel_sockopts, &tunnel_opts))
+		<< "bad --tunnel_sockopts:" << FLAGS_tunnel_sockopts;
+	CHECK(SockOpts::Profile(FLAGS_upstream_sockopts, &g_opts.upstream_opts))
+		<< "bad --upstream_sockopts:" << FLAGS_upstream_sockopts;
+	CHECK(Egress::Configure(FLAGS_egress_ips)) << "bad --egress_ips:" << FLAGS_egress_ips;
+	PreConnect::Configure(FLAGS_preconnect, FLAGS_preconnect_dests,
+			std::chrono::seconds(FLAGS_preconnect_idle_secs), g_opts.upstream_opts);
+	g_opts.tunnel_timeout = std::chrono::milliseconds(FLAGS_tunnel_timeout_ms);
+	ConfigureServer(g_opts);
+	Compressor::Enable(FLAGS_compress);
+	Budget::Configure(FLAGS_mem_budget_mb << 20, FLAGS_max_streams);
+	if (!FLAGS_record_file.empty())
+		CHECK(FrameRecorder::Open(FLAGS_record_file, FLAGS_record_payload)) << "bad --record_file";
+	if (FLAGS_trace)
+		CHECK(Tracer::Enable(FLAGS_trace_file, FLAGS_trace_sample)) << "bad --trace_file";
+	if (!FLAGS_shaping_file.empty())
+		CHECK(Shaper::Init(FLAGS_shaping_file)) << "bad --shaping_file";
+
+	std::unique_ptr<TcpServerSocket> ssk, dsk;
+	std::vector<int> fds;
+	if (!FLAGS_handoff_path.empty() && Handoff::Take(FLAGS_handoff_path, &fds)) {
+		CHECK_EQ(fds.size(), FLAGS_direct_port ? 2u : 1u) << "listeners taken over, keep --direct_port";
+		ssk.reset(new TcpServerSocket(fds[0]));
+		if (FLAGS_direct_port)
+			dsk.reset(new TcpServerSocket(fds[1]));
+	} else if (FLAGS_listen_unix.empty()) {
+		ssk.reset(new TcpServerSocket(SockAddrIn(FLAGS_server_port)));
+		// accepted tunnel sockets inherit these from the listener
+		PLOG_IF(WARNING, !ssk->SetOpts(tunnel_opts)) << "set listener sockopts";
+	} else {
+		ssk.reset(new UnixServerSocket(SockAddrUn(FLAGS_listen_unix)));
+	}
+	ssk->Listen();
+	if (FLAGS_direct_port && !dsk) {
+		dsk.reset(new TcpServerSocket(SockAddrIn(FLAGS_direct_port)));
+		PLOG_IF(WARNING, !dsk->SetOpts(tunnel_opts)) << "set direct listener sockopts";
+		PCHECK(dsk->Listen()) << "listen " << FLAGS_direct_port;
+	}
 	daemon(1, 1);
 	signal(SIGCHLD, SIG_IGN);
 	LOG(INFO) << "--- cfw_server start ---";
-
-	TcpServerSocket ssk{SockAddrIn(FLAGS_server_port)};
-	ssk.Listen();
-	while (true) {
-		TcpSocket csk = ssk.Accept();
+	if (Shaper::on())
+		Shaper::Watch();
+	bool handoff = !FLAGS_handoff_path.empty();
+	if (handoff) {
+		// shared with the process on the other end of the handoff,
+		// accept must not block when that one took the connection
+		PCHECK(ssk->SetNonBlocking()) << "set listener non-blocking";
+		fds = {ssk->sock()};
+		if (dsk) {
+			PCHECK(dsk->SetNonBlocking()) << "set listener non-blocking";
+			fds.push_back(dsk->sock());
+		}
+		Handoff::Serve(FLAGS_handoff_path, fds);
+	}
+	// every tunnel (and direct stream) runs in its own process, which
+	// drains by itself when the listeners are handed off
+	while (!Handoff::draining()) {
+		bool direct = false;
+		TcpSocket csk = (handoff || dsk ? AcceptEither(ssk.get(), dsk.get(), &direct)
+				: ssk->Accept());
+		if (!csk && errno == EAGAIN)
+			continue;
 		PCHECK(csk) << "accept error";
-		LOG(INFO) << "accept new connection";
+		LOG(INFO) << "accept new " << (direct ? "direct " : "") << "connection";
 		if (fork() == 0) {
-			ProcessIoConnection(std::move(csk));
+			if (direct)
+				ProcessDirectConnection(std::move(csk));
+			else
+				ProcessIoConnection(std::move(csk));
 			return 0;
 		}
 	}
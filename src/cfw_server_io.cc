@@ -0,0 +1,635 @@
+#include <poll.h>
+#include <cstring>
+#include <map>
+#include <set>
+#include <glog/logging.h>
+#include "cfw_server_io.h"
+#include "io_engine.h"
+#include "cfw_channel.h"
+#include "cfw_clock.h"
+#include "cfw_crypt.h"
+#include "cfw_compress.h"
+#include "cfw_trace.h"
+#include "cfw_budget.h"
+#include "cfw_record.h"
+#include "cfw_task.h"
+#include "cfw_udp.h"
+#include "cfw_egress.h"
+#include "cfw_pipe.h"
+#include "cfw_shaper.h"
+#include "cfw_preconnect.h"
+
+CFW_NS_BEGIN
+
+static ServerOptions g_opts;
+static Channel<Pkg> g_channel;
+// the cfw_client host of this tunnel process, for shaping rules
+static SockAddrIn g_tunnel_peer;
+
+class ClientDataIo
+{
+public:
+	// start reading from the payload of pkg if set (kConn with early data)
+	ClientDataIo(Key k, std::shared_ptr<StreamAccount> acct, std::shared_ptr<Pkg> pkg = {})
+		: key_(k), acct_(std::move(acct)), pkg_(std::move(pkg)) {}
+	ClientDataIo(const ClientDataIo&) = delete;
+	ClientDataIo& operator=(const ClientDataIo&) = delete;
+	// awaitable read for the protocol handlers, suspends until Deliver()
+	// hands over the next pkg of the stream
+	Task<bool> ReadN(uint8_t* buf, size_t len) {
+		size_t wpos = 0;
+		while (wpos < len) {
+			while (!pkg_ || read_pos_ >= pkg_->data.size()) {
+				auto pkg = co_await PkgAwaiter{this};
+				if (!TakePkg(std::move(pkg)))
+					co_return false;
+			}
+			size_t need = len - wpos;
+		   	size_t left = pkg_->data.length() - read_pos_;
+			size_t copy_len = (need <= left ? need : left);
+			std::memcpy(buf + wpos, pkg_->data.data() + read_pos_, copy_len);
+			wpos += copy_len;
+			read_pos_ += copy_len;
+		}
+		co_return true;
+	}
+	template <class T>
+	Task<bool> ReadValue(T* val) {
+		return ReadN(reinterpret_cast<uint8_t*>(val), sizeof(T));
+	}
+	// resume the handler suspended in ReadN with pkg
+	void Deliver(std::shared_ptr<Pkg> pkg) {
+		CHECK(waiter_) << "thread:" << key() << " no reader for pkg";
+		inbox_ = std::move(pkg);
+		std::exchange(waiter_, {}).resume();
+	}
+	// non-block read from the channel, src gets the pkg the data came from
+	// ret 0:OK 1:EMPTY -1:ERROR
+	int ReadData(Bytes* buf, std::shared_ptr<Pkg>* src = nullptr) {
+		if (!pkg_ || read_pos_ >= pkg_->data.size()) {
+			int r = ReadPkg();
+			if (r != 0) return r;
+		}
+		if (read_pos_ == 0) {
+			*buf = pkg_->data;
+		} else {
+			buf->assign(pkg_->data, read_pos_, Bytes::npos);
+		}
+		if (src)
+			*src = std::move(pkg_);
+		pkg_.reset();
+		read_pos_ = 0;
+		return 0;
+	}
+	void WriteN(const uint8_t* buf, size_t len) {
+		auto pkg = std::make_shared<Pkg>(key_, Cmd::kData);
+		Tracer::Stamp(pkg.get(), kTraceRead);
+		comp_.Pack(buf, len, pkg.get());
+		Budget::Charge(pkg.get(), acct_);
+		Tracer::Stamp(pkg.get(), kTraceQueued);
+		g_channel.Push(0, std::move(pkg));
+   	}
+	void WriteClose() {
+		g_channel.Push(0, std::make_shared<Pkg>(key_, Cmd::kClose));
+	}
+	Key key() const {
+		return key_;
+	}
+	// too much queued, stop reading upstream for a while
+	bool Paused() const {
+		return Budget::ShouldPause(*acct_);
+	}
+protected:
+	struct PkgAwaiter {
+		bool await_ready() const noexcept {
+			return io->inbox_ != nullptr;
+		}
+		void await_suspend(std::coroutine_handle<> h) noexcept {
+			io->waiter_ = h;
+		}
+		std::shared_ptr<Pkg> await_resume() noexcept {
+			return std::move(io->inbox_);
+		}
+		ClientDataIo* io;
+	};
+	int ReadPkg() {
+		auto pkg = g_channel.Pop(key_);
+		if (!pkg)
+			return 1;
+		return TakePkg(std::move(pkg)) ? 0 : -1;
+	}
+	// make pkg the one being read, ret false on kClose or bad pkgs
+	bool TakePkg(std::shared_ptr<Pkg> pkg) {
+		Tracer::Stamp(pkg.get(), kTraceDelivered);
+		if (pkg->cmd != Cmd::kData) {
+			if (pkg->cmd == Cmd::kClose)
+				LOG(INFO) << "thread:" << key() << " channel recv kClose!";
+			else
+				LOG(ERROR) << "thread:" << key()
+					<< " channel recv bad cmd:" << static_cast<unsigned>(pkg->cmd);
+			return false;
+		}
+		if (!Decompress(pkg.get()))
+			return false;
+		pkg_ = std::move(pkg);
+		read_pos_ = 0;
+		return true;
+	}
+private:
+	Key key_;
+	std::shared_ptr<StreamAccount> acct_;
+	Compressor comp_;
+	std::shared_ptr<Pkg> pkg_;
+	size_t read_pos_ = 0;
+	std::shared_ptr<Pkg> inbox_;
+	std::coroutine_handle<> waiter_;
+};
+
+// destination of a stream, as read from the SOCKS request
+struct ConnRequest
+{
+	uint8_t atyp = 0;
+	uint32_t net_order_ip = 0;
+	std::string url;
+	uint16_t net_order_port = 0;
+	// the client waits for a SOCKS reply to CONNECT
+	bool reply = true;
+};
+
+// NOTE: co_await results go through a local, gcc 12 miscompiles
+// co_await inside an if condition
+
+static Task<bool> ProcHandshake(ClientDataIo* io)
+{
+	uint8_t ver, meth_count;
+	bool ok = co_await io->ReadValue(&ver);
+	if (!ok) co_return false;
+	LOG(INFO) << "thread:" << io->key()
+		<< " handshake req ver:" << static_cast<unsigned>(ver);
+	ok = co_await io->ReadValue(&meth_count);
+	if (!ok) co_return false;
+	LOG(INFO) << "thread:" << io->key()
+		<< " handshake req method count:" << static_cast<unsigned>(meth_count);
+	for (uint8_t i = 0; i < meth_count; ++i) {
+		uint8_t meth;
+		ok = co_await io->ReadValue(&meth);
+		if (!ok) co_return false;
+		LOG(INFO) << "thread:" << io->key()
+			<< " handshake req method:" << static_cast<unsigned>(meth);
+	}
+	Buffer buf;
+	buf[0] = ver;
+	buf[1] = 0;
+	io->WriteN(buf.data(), 2);
+	co_return true;
+}
+
+static bool SendCommandResp(ClientDataIo* io, uint8_t reply, const SockAddrIn* bind = nullptr)
+{
+	Buffer rsp_buf;
+	rsp_buf[0] = 5;
+	rsp_buf[1] = reply;
+	rsp_buf[2] = 0;
+	rsp_buf[3] = 1;
+	if (bind) {
+		*reinterpret_cast<uint32_t*>(&rsp_buf[4]) = bind->ip();
+		*reinterpret_cast<uint16_t*>(&rsp_buf[8]) = bind->port();
+	} else {
+		std::memset(&rsp_buf[4], 0, 6);
+	}
+	LOG(INFO) << "thread:" << io->key()
+		<< " SendCommandResp {reply:" << static_cast<unsigned>(reply)
+		<< " bind:" << (bind ? bind->to_str() : "0") << "}";
+	io->WriteN(rsp_buf.data(), 10);
+	return true;
+}
+
+// read DST.ADDR DST.PORT of req->atyp
+static Task<bool> ReadRequestAddr(ClientDataIo* io, ConnRequest* req)
+{
+	bool ok;
+	if (req->atyp == 1) { // ip (v4)
+		ok = co_await io->ReadValue(&req->net_order_ip);
+		if (!ok) {
+			LOG(ERROR) << "thread:" << io->key() << " proc command read ip error";
+			co_return false;
+		}
+	} else if (req->atyp == 3) { // url
+		uint8_t len;
+		char url[256];
+		ok = co_await io->ReadValue(&len);
+		if (ok)
+			ok = co_await io->ReadN(reinterpret_cast<uint8_t*>(url), len);
+		if (!ok) {
+			LOG(ERROR) << "thread:" << io->key() << " proc command read url error";
+			co_return false;
+		}
+		req->url.assign(url, len);
+		LOG(INFO) << "thread:" << io->key() << " request url: " << req->url;
+	} else {
+		LOG(ERROR) << "thread:" << io->key() << " proc command unsurport atyp";
+		if (req->reply)
+			SendCommandResp(io, 1);
+		co_return false;
+	}
+
+	ok = co_await io->ReadValue(&req->net_order_port);
+	if (!ok) {
+		LOG(ERROR) << "thread:" << io->key() << " proc command read port error";
+		co_return false;
+	}
+	co_return true;
+}
+
+// a pooled connection to dst or a new one, *bind gets the local address
+// if set: the SOCKS reply waits for it, so the connect must be done
+static std::shared_ptr<Transport> ConnectUpstream(const SockAddrIn& dst, SockAddrIn* bind)
+{
+	if (g_opts.connect)
+		return g_opts.connect(dst, bind);
+	std::shared_ptr<TcpSocket> sk = PreConnect::Take(dst);
+	if (!sk) {
+		// with fast open connect() returns at once and the handshake only
+		// starts with the early data, too soon to tell the client it worked
+		SockOpts opts = g_opts.upstream_opts;
+		if (bind)
+			opts.fastopen = -1;
+		sk = Egress::Connect(dst, opts);
+	}
+	if (sk && bind)
+		PCHECK(sk->GetSockAddr(bind)) << "GetSockAddr";
+	return sk;
+}
+
+// resolve and connect to the destination of req, blocking so it runs
+// on the stream thread; SOCKS replies are only sent if the client is
+// waiting for them
+static bool ProcConnect(ClientDataIo* io, ConnRequest& req, std::shared_ptr<Transport>* sk)
+{
+	if (req.atyp == 3 && !ResolveIp(req.url.c_str(), &req.net_order_ip)) {
+		LOG(ERROR) << "thread:" << io->key() << "resolve ip error";
+		if (req.reply)
+			SendCommandResp(io, 1);
+		return false;
+	}
+
+	SockAddrIn req_addr{ntohl(req.net_order_ip), ntohs(req.net_order_port)};
+	LOG(INFO) << "thread:" << io->key() << " request connect to "<< req_addr.to_str();
+	SockAddrIn bind_addr;
+	*sk = ConnectUpstream(req_addr, req.reply ? &bind_addr : nullptr);
+	if (!*sk) {
+		PLOG(ERROR) << "thread:" << io->key() << " connect remote server error";
+		if (req.reply)
+			SendCommandResp(io, 1);
+		return false;
+	}
+	if (!req.reply)
+		return true;
+	return SendCommandResp(io, 0, &bind_addr);
+}
+
+static Task<bool> ProcCommand(ClientDataIo* io, ConnRequest* req)
+{
+	uint8_t head[4]; // ver cmd rsv atyp
+	bool ok = co_await io->ReadN(head, sizeof(head));
+	if (!ok) {
+		LOG(ERROR) << "thread:" << io->key() << " proc command read error";
+		co_return false;
+	}
+	uint8_t ver = head[0], cmd = head[1], rsv = head[2];
+	req->atyp = head[3];
+	LOG(INFO) << "thread:" << io->key()
+		<< " proc command ver:" << static_cast<unsigned>(ver)
+		<< " cmd:" << static_cast<unsigned>(cmd)
+		<< " rsv:" << static_cast<unsigned>(rsv)
+		<< " atyp:" << static_cast<unsigned>(req->atyp);
+	if (cmd != 1) {
+		LOG(ERROR) << "thread:" << io->key() << " proc command unsurport cmd";
+		SendCommandResp(io, 1);
+		co_return false;
+	} else if (rsv != 0) {
+		LOG(ERROR) << "thread:" << io->key() << " proc command bad rsv:" << rsv;
+		co_return false;
+	}
+	co_return co_await ReadRequestAddr(io, req);
+}
+
+// kConn from a client that terminated SOCKS itself: the payload is
+// ATYP DST.ADDR DST.PORT followed by early data, the app already got
+// its CONNECT reply so failures can only be reported by kClose
+static Task<bool> ProcEarlyRequest(ClientDataIo* io, ConnRequest* req)
+{
+	req->reply = false;
+	bool ok = co_await io->ReadValue(&req->atyp);
+	if (!ok)
+		co_return false;
+	co_return co_await ReadRequestAddr(io, req);
+}
+
+static Task<bool> ProcRequest(ClientDataIo* io, ConnRequest* req)
+{
+	bool ok = co_await ProcHandshake(io);
+	if (!ok) {
+		LOG(ERROR) << "thread:" << io->key() << " proc handshake error";
+		co_return false;
+	}
+	LOG(INFO) << "thread:" << io->key() << " handshake ok";
+	ok = co_await ProcCommand(io, req);
+	if (!ok) {
+		LOG(ERROR) << "thread:" << io->key() << " proc command error";
+		co_return false;
+	}
+	co_return true;
+}
+
+// relay between the upstream socket and the channel until either side closes
+static void ProcessStream(ClientDataIo* io, std::shared_ptr<Transport> sk, ShapeStream* shape)
+{
+	Key key = io->key();
+	Bytes in;
+	// what upstream has not taken yet
+	OutBuffer out;
+	bool closed = false;
+	time_t last_active = Clock::Time();
+	while (true) {
+		// channel first, so early data from kConn goes out at once;
+		// what a slow upstream leaves stays in the channel
+		while (!closed && out.size() < kOutBufferLimit && !(shape && shape->Paused())) {
+			Bytes data;
+			std::shared_ptr<Pkg> src;
+			int r = io->ReadData(&data, &src);
+			if (r < 0) {
+				LOG(INFO) << "thread:" << key << " channel read failed";
+				closed = true;
+				break;
+			} else if (r > 0) {
+				VLOG(1) << "thread:" << key << " channel empty";
+				break; // go on reading socket
+			}
+			LOG(INFO) << "thread:" << key << " channel read data [" << data.size() << "]";
+			last_active = Clock::Time();
+			if (shape)
+				shape->Charge(data.size());
+			out.Append(std::move(data), std::move(src));
+		}
+		std::vector<std::shared_ptr<Pkg>> written;
+		if (!out.Flush(*sk, &written)) {
+			PLOG(ERROR) << "thread:" << key << " socket send error";
+			if (!closed)
+				io->WriteClose();
+			goto exit;
+		}
+		if (!written.empty())
+			last_active = Clock::Time();
+		for (auto& pkg : written) {
+			Tracer::Stamp(pkg.get(), kTraceWritten);
+			Tracer::Finish(*pkg);
+		}
+		if (closed && out.empty())
+			goto exit;
+
+		int len;
+		in.clear();
+		if (closed) {
+			// the stream is over, wait for upstream to take the rest
+			sk->Poll(POLLOUT, std::chrono::milliseconds(50));
+			len = -1;
+			errno = EAGAIN;
+		} else if (io->Paused() || (shape && shape->Paused())) {
+			// leave the data in the socket buffer until the queues drain
+			Clock::SleepFor(std::chrono::milliseconds(50));
+			continue;
+		} else if (!out.empty()) {
+			// upstream is slow to read, wake up when it takes more too,
+			// read unless only POLLOUT came
+			if (sk->Poll(POLLIN | POLLOUT, std::chrono::milliseconds(50)) & ~POLLOUT) {
+				len = sk->RecvSome(&in, sizeof(Buffer), std::chrono::milliseconds(0));
+			} else {
+				len = -1;
+				errno = EAGAIN;
+			}
+		} else {
+			// wait 50ms for data incoming
+			len = sk->RecvSome(&in, sizeof(Buffer), std::chrono::milliseconds(50));
+		}
+		if (len > 0) {
+			LOG(INFO) << "thread:" << key << " socket recv pkg [" << len << "]";
+			if (shape)
+				shape->Charge(len);
+			io->WriteN(in.data(), len);
+			last_active = Clock::Time();
+		} else if (len < 0 && errno == EAGAIN) {
+			VLOG(1) << "thread:" << key << " socket recv timeout";
+		} else {
+			if (len == 0)
+				LOG(INFO) << "thread:" << key << " socket closed by peer";
+			else 
+				PLOG(INFO) << "thread:" << key << " socket recv error";
+			io->WriteClose();
+			goto exit;
+		}
+
+		if (last_active + 600 < Clock::Time()) {
+			LOG(ERROR) << "thread:" << key << " is dead";
+			goto exit;
+		}
+	};
+exit:
+	g_channel.Free(key);
+	LOG(INFO) << "thread:" << key << " exit";
+}
+
+// A stream still in its SOCKS exchange. The handlers run as coroutines
+// on the io thread and resume as soon as the next pkg of the stream is
+// read from the tunnel, the stream gets a thread once it has to connect.
+struct PendingStream
+{
+	PendingStream(Key k, std::shared_ptr<StreamAccount> acct, std::shared_ptr<Pkg> conn)
+		: io(k, std::move(acct), std::move(conn)) {}
+	ClientDataIo io;
+	ConnRequest req;
+	Task<bool> task;
+	time_t start = Clock::Time();
+};
+
+static void HandleClient(std::unique_ptr<PendingStream> ps)
+{
+	ClientDataIo* io = &ps->io;
+	Key key = io->key();
+	if (!g_channel.Own(key)) {
+		LOG(FATAL) << "client key conflicts";
+	}
+	LOG(INFO) << "thread:" << key << " start";
+	std::shared_ptr<Transport> sk;
+	if (!ProcConnect(io, ps->req, &sk)) {
+		LOG(ERROR) << "thread:" << key << " proc connect error";
+		io->WriteClose();
+		g_channel.Free(key);
+		return;
+	}
+	LOG(INFO) << "thread:" << key << " connect command ok";
+	std::unique_ptr<ShapeStream> shape;
+	if (Shaper::on()) {
+		SockAddrIn dest{ntohl(ps->req.net_order_ip), ntohs(ps->req.net_order_port)};
+		shape.reset(new ShapeStream(key, g_tunnel_peer, dest));
+	}
+	ProcessStream(io, sk, shape.get());
+}
+
+// ret false while the handlers of ps wait for more pkgs, otherwise
+// start the stream thread or close the stream and ret true
+static bool SettleStream(std::unique_ptr<PendingStream>& ps)
+{
+	if (!ps->task.done())
+		return false;
+	if (ps->task.result()) {
+		Clock::Start(HandleClient, std::move(ps)).detach();
+	} else {
+		ps->io.WriteClose();
+		ps.reset();
+	}
+	return true;
+}
+
+// kConn over budget: no thread is started for it. A client waiting for
+// the SOCKS method reply gets "no acceptable methods", one that already
+// got its CONNECT reply (early data) only sees kClose.
+static void RefuseStream(const Pkg& conn)
+{
+	if (conn.data.empty()) {
+		const uint8_t meth_rsp[2] = {5, 0xff};
+		g_channel.Push(0, std::make_shared<Pkg>(conn.key, Cmd::kData, meth_rsp, sizeof(meth_rsp)));
+	}
+	g_channel.Push(0, std::make_shared<Pkg>(conn.key, Cmd::kClose));
+}
+
+void ConfigureServer(const ServerOptions& opts)
+{
+	g_opts = opts;
+}
+
+void ServeTunnel(Transport& sk, const SockAddrIn& peer, uint32_t tunnel_id)
+{
+	g_tunnel_peer = peer;
+	time_t last_gc = Clock::Time();
+	// the client probes, so a silent tunnel is dead
+	auto last_recv = Clock::Now();
+	Crypt enc, dec;
+	// recv and decrypt, encrypt and send run on threads of their own
+	PkgPipe pipe(sk, enc, dec);
+	std::map<Key, std::unique_ptr<PendingStream>> pending;
+	// UDP associations of this tunnel, the relay starts with the first
+	std::unique_ptr<UdpRelay> udp_relay;
+	std::set<Key> udp_keys;
+
+	while (true) {
+		// get PKG from IO connection
+		std::shared_ptr<Pkg> new_pkg;
+		// wait 50ms for pkg incoming, or for the tunnel to take more
+		// while it is backed up
+		int r = pipe.Read(&new_pkg, std::chrono::milliseconds(50));
+		if (r < 0) {
+			PLOG(INFO) << "io socket recv error";
+			break;
+		} else if (r == 0) {
+			last_recv = Clock::Now();
+			Tracer::Stamp(new_pkg.get(), kTraceTunnelRecv);
+			FrameRecorder::Frame(FrameDir::kIn, *new_pkg, tunnel_id);
+			if (new_pkg->cmd == Cmd::kProbe) {
+				// answer behind whatever is queued, so the client sees our load
+				uint32_t depth = static_cast<uint32_t>(g_channel.Size(0));
+				auto echo = std::make_shared<Pkg>(0, Cmd::kProbe,
+						new_pkg->data.data(), new_pkg->data.size());
+				echo->data.append(reinterpret_cast<const uint8_t*>(&depth), sizeof(depth));
+				g_channel.Push(0, std::move(echo));
+			} else if (new_pkg->cmd == Cmd::kConn) {
+				LOG(INFO) << "io socket recv kConn pkg key:" << new_pkg->key;
+				auto acct = Budget::Admit(new_pkg->key);
+				if (pending.count(new_pkg->key)) {
+					LOG(ERROR) << "key:" << new_pkg->key << " client key conflicts";
+				} else if (acct) {
+					bool early = !new_pkg->data.empty();
+					std::unique_ptr<PendingStream> ps(new PendingStream(new_pkg->key,
+								std::move(acct), early ? new_pkg : nullptr));
+					ps->task = early ? ProcEarlyRequest(&ps->io, &ps->req)
+						: ProcRequest(&ps->io, &ps->req);
+					ps->task.Start();
+					if (!SettleStream(ps))
+						pending.emplace(new_pkg->key, std::move(ps));
+				} else {
+					LOG(WARNING) << "key:" << new_pkg->key << " refused, over budget";
+					RefuseStream(*new_pkg);
+				}
+			} else if (new_pkg->cmd == Cmd::kUdp) {
+				if (!udp_relay)
+					udp_relay.reset(new UdpRelay(g_channel));
+				udp_keys.insert(new_pkg->key);
+				udp_relay->Push(std::move(new_pkg));
+			} else if (new_pkg->cmd == Cmd::kClose && udp_keys.erase(new_pkg->key)) {
+				udp_relay->Push(std::move(new_pkg));
+			} else {
+				LOG(INFO) << "io socket recv pkg {key:" << new_pkg->key
+					<< " cmd:" << static_cast<unsigned>(new_pkg->cmd)
+					<< " len:" << new_pkg->data.size() << "}";
+				auto it = pending.find(new_pkg->key);
+				if (it != pending.end()) {
+					it->second->io.Deliver(new_pkg);
+					if (SettleStream(it->second))
+						pending.erase(it);
+				} else {
+					// forward pkg
+					Budget::ChargeStream(new_pkg.get());
+					g_channel.Push(new_pkg->key, new_pkg);
+				}
+			}
+		} else if (Clock::Now() - last_recv > g_opts.tunnel_timeout) {
+			LOG(ERROR) << "tunnel from " << peer.to_str() << " silent, dead";
+			break;
+		}
+
+		bool sent = true;
+		while (sent && !pipe.Full()) {
+			auto pkg = g_channel.Pop(0);
+			if (!pkg) {
+				VLOG(1) << "io channel empty";
+				break;
+			}
+			LOG(INFO) << "io channel recv pkg {key:" << pkg->key
+				<< " cmd:" << static_cast<unsigned>(pkg->cmd)
+				<< " len:" << pkg->data.size() << "}";
+			Tracer::Stamp(pkg.get(), kTraceDequeued);
+			FrameRecorder::Frame(FrameDir::kOut, *pkg, tunnel_id);
+			sent = pipe.Write(std::move(pkg));
+		}
+		// never block on the tunnel, what it does not take waits in the channel
+		if (!sent) {
+			PLOG(ERROR) << "io socket send pkg error";
+			break;
+		}
+		FrameRecorder::Flush();
+
+		time_t now = Clock::Time();
+		if (last_gc + 60 < now) {
+			g_channel.GarbageCleanup(120);
+			for (auto it = pending.begin(); it != pending.end(); ) {
+				if (it->second->start + 120 < now) {
+					LOG(INFO) << "garbage cleanup pending key:" << it->first;
+					it = pending.erase(it);
+				} else {
+					++it;
+				}
+			}
+			LOG(INFO) << IoEngine::StatsString();
+			LOG(INFO) << Compressor::StatsString();
+			LOG(INFO) << Tracer::StatsString();
+			LOG(INFO) << Budget::StatsString();
+			LOG(INFO) << Egress::StatsString();
+			LOG(INFO) << PreConnect::StatsString();
+			last_gc = now;
+		}
+	}
+	// the frames read before the tunnel failed
+	FrameRecorder::Flush();
+}
+
+CFW_NS_END
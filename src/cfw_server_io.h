@@ -0,0 +1,27 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include "socket.h"
+
+CFW_NS_BEGIN
+
+// What the tunnel handlers take from the command line
+struct ServerOptions
+{
+	// drop a tunnel nothing arrived on for this long
+	std::chrono::milliseconds tunnel_timeout{10000};
+	SockOpts upstream_opts;
+	// connects a stream to dst, *bind gets the local address if set;
+	// unset for a PreConnect pooled connection or else Egress::Connect
+	std::function<std::shared_ptr<Transport>(const SockAddrIn& dst, SockAddrIn* bind)> connect;
+};
+
+// before the first ServeTunnel
+void ConfigureServer(const ServerOptions& opts);
+// relay the tunnel from peer over sk until it fails or goes silent,
+// tunnel_id tells the tunnels apart in --record_file
+void ServeTunnel(Transport& sk, const SockAddrIn& peer, uint32_t tunnel_id);
+
+CFW_NS_END
@@ -0,0 +1,368 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <atomic>
+#include <cerrno>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <glog/logging.h>
+#include "cfw_clock.h"
+#include "cfw_shaper.h"
+
+CFW_NS_BEGIN
+
+namespace {
+
+const size_t kMaxRules = 256;
+
+enum RuleKind : uint8_t
+{
+	kRuleNone = 0,
+	kRuleClient = 1,
+	kRuleDest = 2
+};
+
+// in memory shared by the tunnel processes, the fields are guarded by
+// lock, the counters are not
+struct Rule
+{
+	pthread_mutex_t lock;	// robust and process shared, see Init
+	uint8_t kind = kRuleNone;
+	uint32_t ip = 0;
+	uint32_t mask = 0;
+	uint16_t port = 0;	// 0 for any
+	uint64_t rate = 0;	// bytes/s
+	uint64_t burst = 0;
+	int64_t tokens = 0;
+	uint64_t last_ns = 0;
+	std::atomic<uint64_t> bytes{0};
+	std::atomic<uint64_t> pauses{0};
+};
+
+struct Table
+{
+	// bumped by every reload, streams match their rules again
+	std::atomic<uint32_t> gen{1};
+	std::atomic<uint32_t> count{0};
+	Rule rules[kMaxRules];
+};
+
+// the fields of a Rule a reload sets
+struct RuleConf
+{
+	uint8_t kind;
+	uint32_t ip;
+	uint32_t mask;
+	uint16_t port;
+	uint64_t rate;
+	uint64_t burst;
+};
+
+class RuleLock
+{
+public:
+	explicit RuleLock(Rule& r) : r_(r) {
+		// a tunnel process died holding it, the bucket may be off by
+		// one charge which the next refill or reload evens out
+		if (pthread_mutex_lock(&r_.lock) == EOWNERDEAD)
+			pthread_mutex_consistent(&r_.lock);
+	}
+	~RuleLock() {
+		pthread_mutex_unlock(&r_.lock);
+	}
+private:
+	Rule& r_;
+};
+
+} // namespace
+
+static Table* g_table = nullptr;
+static std::string g_path;
+
+static uint64_t NowNs()
+{
+	return static_cast<uint64_t>(Clock::Now().count());
+}
+
+// refill by the time passed, caller holds the lock. last_ns only moves
+// by the time turned into whole tokens so frequent calls lose nothing
+static void Refill(Rule& r, uint64_t now)
+{
+	if (now <= r.last_ns)
+		return;
+	__int128 add = static_cast<__int128>(r.rate) * (now - r.last_ns) / 1000000000;
+	if (add == 0)
+		return;
+	if (r.tokens + add >= static_cast<__int128>(r.burst)) {
+		r.tokens = static_cast<int64_t>(r.burst);
+		r.last_ns = now;
+	} else {
+		r.tokens += static_cast<int64_t>(add);
+		r.last_ns += static_cast<uint64_t>(add * 1000000000 / r.rate);
+	}
+}
+
+// ADDR[/BITS][:PORT], * for any
+static bool ParseMatch(const std::string& str, RuleConf* conf)
+{
+	std::string addr = str;
+	conf->port = 0;
+	size_t colon = addr.find(':');
+	if (colon != std::string::npos) {
+		conf->port = static_cast<uint16_t>(std::stoi(addr.substr(colon + 1)));
+		addr.resize(colon);
+	}
+	int bits = 32;
+	size_t slash = addr.find('/');
+	if (slash != std::string::npos) {
+		bits = std::stoi(addr.substr(slash + 1));
+		addr.resize(slash);
+	}
+	if (addr == "*") {
+		addr = "0.0.0.0";
+		bits = 0;
+	}
+	in_addr in;
+	if (bits < 0 || bits > 32 || inet_pton(AF_INET, addr.c_str(), &in) != 1)
+		return false;
+	conf->mask = (bits == 0 ? 0 : 0xffffffffu << (32 - bits));
+	conf->ip = ntohl(in.s_addr) & conf->mask;
+	return true;
+}
+
+static bool LoadRules(const std::string& path, std::vector<RuleConf>* confs)
+{
+	std::ifstream in(path);
+	if (!in) {
+		PLOG(ERROR) << "open shaping file " << path;
+		return false;
+	}
+	std::string line;
+	int lineno = 0;
+	while (std::getline(in, line)) {
+		++lineno;
+		size_t hash = line.find('#');
+		if (hash != std::string::npos)
+			line.resize(hash);
+		std::istringstream ss(line);
+		std::string kind, match;
+		uint64_t kbps, burst_kb = 0;
+		if (!(ss >> kind))
+			continue;
+		RuleConf conf;
+		bool ok = (ss >> match >> kbps) && (kind == "client" || kind == "dest");
+		if (ok && !(ss >> burst_kb))
+			burst_kb = kbps;	// a second worth
+		try {
+			ok = ok && ParseMatch(match, &conf);
+		} catch (const std::exception&) {
+			ok = false;
+		}
+		if (!ok || kbps == 0 || confs->size() >= kMaxRules) {
+			LOG(ERROR) << "bad shaping rule " << path << ":" << lineno << " " << line;
+			return false;
+		}
+		conf.kind = (kind == "client" ? kRuleClient : kRuleDest);
+		if (conf.kind == kRuleClient && conf.port != 0) {
+			// neither the tunnel peer nor the app address has a port
+			// worth matching, the former changes with every reconnect
+			LOG(ERROR) << "client shaping rule with a port " << path << ":" << lineno << " " << line;
+			return false;
+		}
+		conf.rate = kbps * 1024;
+		conf.burst = burst_kb * 1024;
+		confs->push_back(conf);
+	}
+	return true;
+}
+
+static void ApplyRules(const std::vector<RuleConf>& confs)
+{
+	uint64_t now = NowNs();
+	for (size_t i = 0; i < kMaxRules; ++i) {
+		Rule& r = g_table->rules[i];
+		RuleLock lock(r);
+		const RuleConf* c = (i < confs.size() ? &confs[i] : nullptr);
+		r.kind = (c ? c->kind : kRuleNone);
+		if (c) {
+			r.ip = c->ip;
+			r.mask = c->mask;
+			r.port = c->port;
+			r.rate = c->rate;
+			r.burst = c->burst;
+			r.tokens = c->burst;
+			r.last_ns = now;
+		}
+		r.bytes = 0;
+		r.pauses = 0;
+	}
+	g_table->count = static_cast<uint32_t>(confs.size());
+	g_table->gen.fetch_add(1);
+}
+
+bool Shaper::Init(const std::string& path)
+{
+	std::vector<RuleConf> confs;
+	if (!LoadRules(path, &confs))
+		return false;
+	void* p = ::mmap(nullptr, sizeof(Table), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		PLOG(ERROR) << "mmap shaping table";
+		return false;
+	}
+	g_table = new (p) Table;
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	// a tunnel process killed inside Charge must not wedge the others
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	for (Rule& r : g_table->rules)
+		pthread_mutex_init(&r.lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	g_path = path;
+	ApplyRules(confs);
+	LOG(INFO) << "shaping rules:" << confs.size() << " from " << path;
+	return true;
+}
+
+void Shaper::Watch()
+{
+	std::thread([] {
+		struct stat last = {};
+		::stat(g_path.c_str(), &last);
+		time_t last_stats = ::time(nullptr);
+		while (true) {
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+			struct stat st;
+			if (::stat(g_path.c_str(), &st) == 0 && (st.st_mtim.tv_sec != last.st_mtim.tv_sec ||
+					st.st_mtim.tv_nsec != last.st_mtim.tv_nsec || st.st_size != last.st_size)) {
+				last = st;
+				std::vector<RuleConf> confs;
+				if (LoadRules(g_path, &confs)) {
+					LOG(INFO) << StatsString();
+					ApplyRules(confs);
+					LOG(INFO) << "shaping rules reloaded:" << confs.size();
+				}
+			}
+			if (last_stats + 60 < ::time(nullptr)) {
+				LOG(INFO) << StatsString();
+				last_stats = ::time(nullptr);
+			}
+		}
+	}).detach();
+}
+
+bool Shaper::on()
+{
+	return g_table != nullptr;
+}
+
+std::string Shaper::StatsString()
+{
+	if (!g_table)
+		return "shaper off";
+	std::string str = "shaper";
+	uint32_t count = g_table->count;
+	for (uint32_t i = 0; i < count && i < kMaxRules; ++i) {
+		Rule& r = g_table->rules[i];
+		char buf[160];
+		uint32_t ip;
+		uint32_t mask;
+		uint16_t port;
+		uint64_t rate;
+		uint8_t kind;
+		{
+			RuleLock lock(r);
+			kind = r.kind;
+			ip = r.ip;
+			mask = r.mask;
+			port = r.port;
+			rate = r.rate;
+		}
+		int bits = __builtin_popcount(mask);
+		snprintf(buf, sizeof(buf), " [%s %s/%d:%u %lluKB/s bytes:%llu pauses:%llu]",
+				kind == kRuleClient ? "client" : "dest",
+				SockAddrIn(ip, 0).to_str().c_str(), bits, static_cast<unsigned>(port),
+				static_cast<unsigned long long>(rate / 1024),
+				static_cast<unsigned long long>(r.bytes.load()),
+				static_cast<unsigned long long>(r.pauses.load()));
+		str += buf;
+	}
+	return str;
+}
+
+ShapeStream::ShapeStream(Key key, const SockAddrIn& tunnel_peer, const SockAddrIn& dest)
+	: dest_(dest)
+{
+	client_ips_[0] = tunnel_peer.ip();
+	// keys of UNIX socket clients carry no address, see MakeKey
+	uint32_t app_ip = static_cast<uint32_t>(key >> 32);
+	client_ips_[1] = (app_ip == 0xffffffff ? tunnel_peer.ip() : app_ip);
+}
+
+void ShapeStream::Match()
+{
+	rules_[0] = rules_[1] = -1;
+	uint32_t gen;
+	do {
+		gen = g_table->gen;
+		uint32_t count = g_table->count;
+		for (uint32_t i = 0; i < count && i < kMaxRules; ++i) {
+			Rule& r = g_table->rules[i];
+			RuleLock lock(r);
+			if (r.kind == kRuleClient && rules_[0] < 0 &&
+					((client_ips_[0] & r.mask) == r.ip || (client_ips_[1] & r.mask) == r.ip))
+				rules_[0] = i;
+			else if (r.kind == kRuleDest && rules_[1] < 0 && (dest_.ip() & r.mask) == r.ip &&
+					(r.port == 0 || r.port == dest_.port()))
+				rules_[1] = i;
+		}
+	} while (gen != g_table->gen);
+	gen_ = gen;
+}
+
+void ShapeStream::Charge(size_t bytes)
+{
+	if (gen_ != g_table->gen)
+		Match();
+	uint64_t now = NowNs();
+	for (int i : rules_) {
+		if (i < 0)
+			continue;
+		Rule& r = g_table->rules[i];
+		RuleLock lock(r);
+		Refill(r, now);
+		r.tokens -= static_cast<int64_t>(bytes);
+		r.bytes.fetch_add(bytes, std::memory_order_relaxed);
+	}
+}
+
+bool ShapeStream::Paused()
+{
+	if (gen_ != g_table->gen)
+		Match();
+	uint64_t now = NowNs();
+	bool debt = false;
+	for (int i : rules_) {
+		if (i < 0)
+			continue;
+		Rule& r = g_table->rules[i];
+		RuleLock lock(r);
+		Refill(r, now);
+		if (r.tokens < 0) {
+			debt = true;
+			if (!paused_)
+				r.pauses.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+	paused_ = debt;
+	return debt;
+}
+
+CFW_NS_END
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include "socket.h"
+
+CFW_NS_BEGIN
+
+// Token bucket rate limits shared by all tunnel processes of a server.
+// Rules come from a file, one per line:
+//   client ADDR[/BITS] KB/s [BURST_KB]
+//   dest ADDR[/BITS][:PORT] KB/s [BURST_KB]
+// A client rule matches the cfw_client host a tunnel comes from or the
+// app address a stream key carries, a dest rule the upstream address.
+// Every rule is one bucket for all streams it matches, bytes of both
+// directions count, and a stream is charged to the first client and
+// the first dest rule it matches. Streams in debt stop reading until
+// the bucket refills, nothing is dropped. The file is reloaded when it
+// changes, which resets the buckets.
+class Shaper
+{
+public:
+	// map the shared rule table, before tunnel processes are forked
+	static bool Init(const std::string& path);
+	// reload the file when it changes and log the counters, from a
+	// thread; call after daemon()
+	static void Watch();
+	static bool on();
+	static std::string StatsString();
+};
+
+// the buckets one stream is charged to
+class ShapeStream
+{
+public:
+	ShapeStream(Key key, const SockAddrIn& tunnel_peer, const SockAddrIn& dest);
+	void Charge(size_t bytes);
+	// some bucket of the stream is in debt
+	bool Paused();
+private:
+	void Match();
+
+	uint32_t client_ips_[2];
+	SockAddrIn dest_;
+	uint32_t gen_ = 0;
+	// client and dest rule, -1 for none
+	int rules_[2] = {-1, -1};
+	bool paused_ = false;
+};
+
+CFW_NS_END
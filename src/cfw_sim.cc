@@ -0,0 +1,262 @@
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include "cfw_budget.h"
+#include "cfw_client_io.h"
+#include "cfw_clock.h"
+#include "cfw_compress.h"
+#include "cfw_memlink.h"
+#include "cfw_server_io.h"
+#include "cfw_shaper.h"
+
+using namespace cfw;
+
+// Runs the client and server handlers (HandleStream, the tunnel io
+// loops with their PkgPipe stages and probes, the server SOCKS
+// coroutines and ProcessStream) on a virtual clock, over in-memory
+// links. Each stream is an app doing SOCKS CONNECT to an echo server
+// and checking what comes back; it completes once all of it has. Both
+// ends share the process wide Budget. UDP ASSOCIATE and --direct_port
+// need real sockets and are not simulated. The same flags and --seed
+// give the same run.
+DEFINE_uint64(streams, 100, "streams to run");
+DEFINE_uint64(stream_kb, 64, "KB each stream sends and gets echoed");
+DEFINE_uint64(ramp_ms, 0, "open the streams evenly over this long, 0 for all at once");
+DEFINE_uint64(latency_ms, 20, "one way latency of the tunnel link");
+DEFINE_uint64(bandwidth_kbps, 100000, "tunnel link bandwidth each way in KB/s, 0 for no limit");
+DEFINE_double(loss, 0, "share of tunnel segments lost, each one is resent after --rto_ms");
+DEFINE_uint64(rto_ms, 200, "retransmission delay of lost segments");
+DEFINE_uint64(link_buffer_kb, 1024, "tunnel bytes in flight each way before sends stall");
+DEFINE_uint64(upstream_latency_ms, 1, "one way latency from the server to the echo servers");
+DEFINE_uint64(seed, 1, "loss seed");
+DEFINE_uint64(max_secs, 3600, "give up after this much virtual time");
+DEFINE_bool(socks_local, false, "answer SOCKS in the client, as cfw_client --socks_local does");
+DEFINE_bool(compress, false, "compress data sent over the tunnel when it pays off");
+DEFINE_uint64(mem_budget_mb, 0, "refuse new streams and pause the heaviest ones when queued pkgs"
+		" hold more than this, 0 for no limit");
+DEFINE_uint64(max_streams, 0, "refuse new streams beyond this many, 0 for no limit; both ends"
+		" count each stream in the one Budget they share");
+DEFINE_string(shaping_file, "", "server shaping rules as for cfw_server, the client is 127.0.0.1"
+		" and stream n goes to 10.0.0.n:80");
+DEFINE_uint64(probe_ms, 1000, "probe interval of the tunnel");
+DEFINE_uint64(tunnel_timeout_ms, 5000, "client and server drop a tunnel silent for this long");
+
+namespace {
+
+// how long an app or echo server waits for the other end
+const std::chrono::seconds kPeerWait(600);
+
+struct SimStream
+{
+	Key key;
+	int64_t start_ns = 0;
+	size_t sent = 0;
+	size_t echoed = 0;
+};
+
+struct SimStats
+{
+	uint64_t done = 0;
+	uint64_t failed = 0;
+	uint64_t corrupt = 0;
+	uint64_t bytes = 0;
+	std::vector<int64_t> finish_ns;
+};
+
+// the clock threads run one at a time, they share these unlocked
+Worker* g_worker = nullptr;
+SimStats g_stats;
+bool g_tunnel_down = false;
+
+// the data every stream sends, so echoes can be checked in place
+inline uint8_t Pattern(Key key, size_t off)
+{
+	return static_cast<uint8_t>(key * 31 + off);
+}
+
+void RunEcho(std::shared_ptr<Transport> sk)
+{
+	Bytes buf;
+	while (true) {
+		buf.clear();
+		int r = sk->RecvSome(&buf, 65536, kPeerWait);
+		if (r == 0 || (r < 0 && errno != EAGAIN))
+			return;
+		if (r > 0 && !sk->WriteN(buf.data(), buf.size(), kPeerWait))
+			return;
+	}
+}
+
+// upstream connects of the server: to a new echo server, an RTT later
+std::shared_ptr<Transport> SimConnect(const SockAddrIn& dst, SockAddrIn* bind)
+{
+	LinkParams params;
+	params.latency = std::chrono::milliseconds(FLAGS_upstream_latency_ms);
+	Clock::SleepFor(2 * params.latency);
+	auto link = MemTransport::Pair(params, static_cast<uint32_t>(FLAGS_seed));
+	if (bind)
+		*bind = SockAddrIn(0x0a000001, dst.port());
+	Clock::Start(RunEcho, std::shared_ptr<Transport>(std::move(link.second))).detach();
+	return std::shared_ptr<Transport>(std::move(link.first));
+}
+
+// SOCKS CONNECT through the client, then send the pattern and read it back
+bool RunApp(Transport& app, SimStream* s)
+{
+	const size_t total = FLAGS_stream_kb * 1024;
+	const uint8_t greeting[3] = {5, 1, 0};
+	uint8_t req[10] = {5, 1, 0, 1};
+	uint32_t ip = htonl(0x0a000000 + static_cast<uint32_t>(s->key));
+	uint16_t port = htons(80);
+	std::memcpy(req + 4, &ip, sizeof(ip));
+	std::memcpy(req + 8, &port, sizeof(port));
+	uint8_t rsp[10];
+	if (!app.WriteN(greeting, sizeof(greeting), kPeerWait) || !app.ReadN(rsp, 2, kPeerWait) ||
+			rsp[1] != 0 || !app.WriteN(req, sizeof(req), kPeerWait) ||
+			!app.ReadN(rsp, sizeof(rsp), kPeerWait) || rsp[1] != 0)
+		return false;
+	Buffer buf;
+	Bytes in;
+	bool corrupt = false;
+	while (s->echoed < total) {
+		bool moved = false;
+		if (s->sent < total) {
+			size_t n = std::min(sizeof(buf), total - s->sent);
+			for (size_t i = 0; i < n; ++i)
+				buf[i] = Pattern(s->key, s->sent + i);
+			iovec iov = {buf.data(), n};
+			int r = app.SendSome(&iov, 1);
+			if (r < 0 && errno != EAGAIN)
+				return false;
+			if (r > 0) {
+				s->sent += r;
+				moved = true;
+			}
+		}
+		in.clear();
+		int r = app.RecvSome(&in, 65536, std::chrono::milliseconds(0));
+		if (r == 0 || (r < 0 && errno != EAGAIN))
+			return false;
+		if (r > 0) {
+			for (size_t i = 0; i < in.size() && !corrupt; ++i)
+				corrupt = (in[i] != Pattern(s->key, s->echoed + i));
+			s->echoed += r;
+			g_stats.bytes += r;
+			moved = true;
+		}
+		if (!moved && app.Poll(POLLIN | (s->sent < total ? POLLOUT : 0), kPeerWait) <= 0)
+			return false;
+	}
+	if (corrupt || s->echoed != total)
+		++g_stats.corrupt;
+	return true;
+}
+
+// one app connection, accepted by the client as it would be from a socket
+void StartStream(SimStream* s)
+{
+	Clock::SleepFor(std::chrono::nanoseconds(s->start_ns));
+	auto link = MemTransport::Pair(LinkParams(), static_cast<uint32_t>(FLAGS_seed));
+	std::shared_ptr<Transport> csk(std::move(link.second));
+	Key key = s->key;
+	Clock::Start([csk, key] { HandleStream(g_worker, *csk, key); }).detach();
+	if (RunApp(*link.first, s)) {
+		++g_stats.done;
+		g_stats.finish_ns.push_back(Clock::Now().count() - s->start_ns);
+	} else {
+		++g_stats.failed;
+	}
+}
+
+int64_t Percentile(std::vector<int64_t>& v, double p)
+{
+	if (v.empty())
+		return 0;
+	size_t i = std::min(v.size() - 1, static_cast<size_t>(v.size() * p));
+	std::nth_element(v.begin(), v.begin() + i, v.end());
+	return v[i];
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	// the handlers log every pkg, --minloglevel=0 to see them
+	FLAGS_minloglevel = 1;
+	google::ParseCommandLineFlags(&argc, &argv, true);
+	google::InitGoogleLogging(argv[0]);
+	FLAGS_logtostderr = true;
+	CHECK_GT(FLAGS_streams, 0u) << "bad --streams";
+	Clock::UseVirtual();
+	Compressor::Enable(FLAGS_compress);
+	Budget::Configure(FLAGS_mem_budget_mb << 20, FLAGS_max_streams);
+	if (!FLAGS_shaping_file.empty())
+		CHECK(Shaper::Init(FLAGS_shaping_file)) << "bad --shaping_file";
+
+	ClientOptions copts;
+	copts.socks_local = FLAGS_socks_local;
+	copts.probe = std::chrono::milliseconds(FLAGS_probe_ms);
+	copts.tunnel_timeout = std::chrono::milliseconds(FLAGS_tunnel_timeout_ms);
+	Worker worker(0, copts);
+	worker.tunnels.emplace_back(new Tunnel("sim", 0));
+	g_worker = &worker;
+	ServerOptions sopts;
+	sopts.tunnel_timeout = std::chrono::milliseconds(FLAGS_tunnel_timeout_ms);
+	sopts.connect = SimConnect;
+	ConfigureServer(sopts);
+
+	LinkParams params;
+	params.latency = std::chrono::milliseconds(FLAGS_latency_ms);
+	params.bandwidth = FLAGS_bandwidth_kbps * 1024;
+	params.loss = FLAGS_loss;
+	params.rto = std::chrono::milliseconds(FLAGS_rto_ms);
+	params.buffer = FLAGS_link_buffer_kb * 1024;
+	auto link = MemTransport::Pair(params, static_cast<uint32_t>(FLAGS_seed));
+	MemTransport* client_end = link.first.get();
+	MemTransport* server_end = link.second.get();
+	Tunnel* tunnel = worker.tunnels[0].get();
+	// either end ends the run when its tunnel loop gives up
+	Clock::Start([client_end, tunnel] {
+		RunTunnel(g_worker, tunnel, *client_end);
+		g_tunnel_down = true;
+	}).detach();
+	Clock::Start([server_end] {
+		ServeTunnel(*server_end, SockAddrIn(0x7f000001, 0), 1);
+		g_tunnel_down = true;
+	}).detach();
+
+	std::vector<SimStream> streams(FLAGS_streams);
+	for (size_t i = 0; i < streams.size(); ++i) {
+		streams[i].key = i + 1;
+		streams[i].start_ns = static_cast<int64_t>(FLAGS_ramp_ms * 1000000 * i / streams.size());
+		Clock::Start(StartStream, &streams[i]).detach();
+	}
+
+	auto wall_start = std::chrono::steady_clock::now();
+	Clock::WaitUntil(std::chrono::seconds(FLAGS_max_secs), [&] {
+		bool over = g_tunnel_down || g_stats.done + g_stats.failed == streams.size();
+		return over ? 0 : Clock::kNever;
+	});
+
+	double secs = Clock::Now().count() / 1e9;
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+	bool ok = !g_tunnel_down && g_stats.done == streams.size() && g_stats.corrupt == 0;
+	printf("sim %s virtual:%.3fs wall:%.3fs streams:%lu/%zu failed:%lu corrupt:%lu"
+			" echoed_MB:%.3f MB/s:%.3f lost_segments:%lu%s\n",
+			g_stats.done == streams.size() ? "done" : "incomplete", secs, wall,
+			g_stats.done, streams.size(), g_stats.failed, g_stats.corrupt, g_stats.bytes / 1e6,
+			secs > 0 ? g_stats.bytes / secs / 1e6 : 0, client_end->lost() + server_end->lost(),
+			g_tunnel_down ? " tunnel down" : "");
+	printf("stream completion ms p50:%ld p99:%ld max:%ld\n",
+			Percentile(g_stats.finish_ns, 0.5) / 1000000, Percentile(g_stats.finish_ns, 0.99) / 1000000,
+			Percentile(g_stats.finish_ns, 1.0) / 1000000);
+	fflush(stdout);
+	// the handler threads still wait on the clock, there is no stopping them
+	_exit(ok ? 0 : 1);
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include "cfw.h"
+
+CFW_NS_BEGIN
+
+// Lazily started coroutine returning T. Awaiting a Task runs it and
+// resumes the awaiter when it finishes; a top level Task is driven with
+// Start() and polled with done(). Destroying a Task destroys its frame
+// and, through the temporaries in it, every task it is awaiting.
+template <class T>
+class Task
+{
+public:
+	struct promise_type;
+	using Handle = std::coroutine_handle<promise_type>;
+
+	struct FinalAwaiter {
+		bool await_ready() noexcept {
+			return false;
+		}
+		std::coroutine_handle<> await_suspend(Handle h) noexcept {
+			auto cont = h.promise().cont;
+			return cont ? cont : std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+
+	struct promise_type {
+		Task get_return_object() {
+			return Task(Handle::from_promise(*this));
+		}
+		std::suspend_always initial_suspend() noexcept {
+			return {};
+		}
+		FinalAwaiter final_suspend() noexcept {
+			return {};
+		}
+		void return_value(T v) {
+			value = std::move(v);
+		}
+		void unhandled_exception() {
+			std::terminate();
+		}
+		T value{};
+		std::coroutine_handle<> cont;
+	};
+
+	Task() = default;
+	Task(Task&& t) noexcept : h_(std::exchange(t.h_, {})) {}
+	Task& operator=(Task&& t) noexcept {
+		if (this != &t) {
+			if (h_)
+				h_.destroy();
+			h_ = std::exchange(t.h_, {});
+		}
+		return *this;
+	}
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+	~Task() {
+		if (h_)
+			h_.destroy();
+	}
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) noexcept {
+		h_.promise().cont = cont;
+		return h_;
+	}
+	T await_resume() {
+		return std::move(h_.promise().value);
+	}
+
+	// run until the first suspension
+	void Start() {
+		h_.resume();
+	}
+	bool done() const {
+		return h_.done();
+	}
+	T& result() {
+		return h_.promise().value;
+	}
+
+private:
+	explicit Task(Handle h) : h_(h) {}
+	Handle h_;
+};
+
+CFW_NS_END
@@ -0,0 +1,178 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <cstring>
+#include <glog/logging.h>
+#include "cfw_clock.h"
+#include "cfw_trace.h"
+
+CFW_NS_BEGIN
+
+// bucket b counts latencies in [2^(b-1), 2^b) us, bucket 0 is < 1us
+static const int kBuckets = 24;
+static const uint64_t kRingRecords = 65536;
+
+struct Histogram
+{
+	std::atomic<uint64_t> count{0};
+	std::atomic<uint64_t> buckets[kBuckets];
+	Histogram() {
+		for (auto& b : buckets)
+			b = 0;
+	}
+};
+
+// spans are named after the stage they end at
+static const char* const kSpanNames[kTraceStages] = {
+	"", "pack", "out_queue", "send", "", "in_queue", "write"
+};
+
+std::atomic<bool> Tracer::on_{false};
+static Histogram g_spans[kTraceStages];
+static Histogram g_out_total;
+static Histogram g_in_total;
+static uint64_t g_sample = 0;
+static std::atomic<uint64_t> g_finished{0};
+static TraceRingHead* g_ring = nullptr;
+
+static inline uint64_t NowNs()
+{
+	// vDSO, no syscall; virtual time under cfw_sim
+	return static_cast<uint64_t>(Clock::Now().count());
+}
+
+static void Record(Histogram* h, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int b = 0;
+	while (us && b < kBuckets - 1) {
+		us >>= 1;
+		++b;
+	}
+	h->count.fetch_add(1, std::memory_order_relaxed);
+	h->buckets[b].fetch_add(1, std::memory_order_relaxed);
+}
+
+static TraceRingHead* MapRing(const std::string& path)
+{
+	size_t size = sizeof(TraceRingHead) + kRingRecords * sizeof(TraceRecord);
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		PLOG(ERROR) << "open trace file " << path;
+		return nullptr;
+	}
+	if (::ftruncate(fd, size) < 0) {
+		PLOG(ERROR) << "ftruncate trace file " << path;
+		::close(fd);
+		return nullptr;
+	}
+	void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (p == MAP_FAILED) {
+		PLOG(ERROR) << "mmap trace file " << path;
+		return nullptr;
+	}
+	auto head = static_cast<TraceRingHead*>(p);
+	std::memcpy(head->magic, kTraceMagic, sizeof(head->magic));
+	head->version = 1;
+	head->record_size = sizeof(TraceRecord);
+	head->capacity = kRingRecords;
+	head->next = 0;
+	return head;
+}
+
+bool Tracer::Enable(const std::string& ring_file, uint64_t sample)
+{
+	if (!ring_file.empty() && sample) {
+		g_ring = MapRing(ring_file);
+		if (!g_ring)
+			return false;
+		g_sample = sample;
+	}
+	on_ = true;
+	return true;
+}
+
+void Tracer::DoStamp(Pkg* pkg, TraceStage stage)
+{
+	if (!pkg->trace) {
+		if (stage != kTraceRead && stage != kTraceTunnelRecv)
+			return;
+		pkg->trace = std::make_shared<PkgTrace>();
+	}
+	pkg->trace->ts[stage] = NowNs();
+}
+
+void Tracer::DoFinish(const Pkg& pkg)
+{
+	const uint64_t* ts = pkg.trace->ts;
+	int first = -1, prev = -1;
+	for (int s = 0; s < kTraceStages; ++s) {
+		if (!ts[s])
+			continue;
+		if (prev >= 0)
+			Record(&g_spans[s], ts[s] - ts[prev]);
+		else
+			first = s;
+		prev = s;
+	}
+	if (first < 0 || first == prev)
+		return;
+	Record(first < kTraceTunnelRecv ? &g_out_total : &g_in_total, ts[prev] - ts[first]);
+
+	if (!g_ring || g_finished.fetch_add(1, std::memory_order_relaxed) % g_sample)
+		return;
+	uint64_t idx = g_ring->next.fetch_add(1, std::memory_order_relaxed) % kRingRecords;
+	auto rec = reinterpret_cast<TraceRecord*>(g_ring + 1) + idx;
+	rec->key = pkg.key;
+	rec->cmd = static_cast<uint8_t>(pkg.cmd);
+	rec->flags = pkg.flags;
+	rec->pad = 0;
+	rec->len = static_cast<uint32_t>(pkg.data.size());
+	std::memcpy(rec->ts, ts, sizeof(rec->ts));
+}
+
+static void AppendHistogram(std::string* str, const char* name, const Histogram& h)
+{
+	uint64_t n = h.count.load(std::memory_order_relaxed);
+	if (!n)
+		return;
+	// percentiles are reported as the bucket upper bound
+	uint64_t p50 = 0, p99 = 0, max = 0, seen = 0;
+	for (int b = 0; b < kBuckets; ++b) {
+		uint64_t c = h.buckets[b].load(std::memory_order_relaxed);
+		if (!c)
+			continue;
+		uint64_t bound = 1ull << b;
+		seen += c;
+		if (!p50 && seen * 2 >= n)
+			p50 = bound;
+		if (!p99 && seen * 100 >= n * 99)
+			p99 = bound;
+		max = bound;
+	}
+	char buf[128];
+	snprintf(buf, sizeof(buf), " %s{n:%llu p50<%lluus p99<%lluus max<%lluus}", name,
+			static_cast<unsigned long long>(n),
+			static_cast<unsigned long long>(p50),
+			static_cast<unsigned long long>(p99),
+			static_cast<unsigned long long>(max));
+	*str += buf;
+}
+
+std::string Tracer::StatsString()
+{
+	if (!on_)
+		return "trace off";
+	std::string str = "trace";
+	for (int s = 0; s < kTraceStages; ++s) {
+		if (kSpanNames[s][0])
+			AppendHistogram(&str, kSpanNames[s], g_spans[s]);
+	}
+	AppendHistogram(&str, "out", g_out_total);
+	AppendHistogram(&str, "in", g_in_total);
+	return str;
+}
+
+CFW_NS_END
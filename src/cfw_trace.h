@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include "cfw.h"
+
+CFW_NS_BEGIN
+
+// Stage boundaries a pkg crosses inside one process. Outbound pkgs go
+// Read..Sent, inbound ones TunnelRecv..Written; clocks of the two hosts
+// aren't synced, so time on the wire itself is not measured.
+enum TraceStage : uint8_t
+{
+	kTraceRead = 0,		// payload read from the local/upstream socket
+	kTraceQueued,		// packed and pushed to the tunnel queue
+	kTraceDequeued,		// popped by the tunnel io thread
+	kTraceSent,			// encrypted and handed to the tunnel socket
+	kTraceTunnelRecv,	// parsed from the tunnel
+	kTraceDelivered,	// popped by the stream thread
+	kTraceWritten,		// written to the local/upstream socket
+	kTraceStages
+};
+
+struct PkgTrace
+{
+	uint64_t ts[kTraceStages] = {};	// Clock::Now() ns, 0 if not reached
+};
+
+// Sampled traces go to a ring file made of a TraceRingHead followed by
+// `capacity` TraceRecords, record `next % capacity` is written next.
+// The ring is mmap'ed shared, so forked server processes append to it
+// too. A record being overwritten while read may be torn.
+const char kTraceMagic[8] = {'C', 'F', 'W', 'T', 'R', 'A', 'C', 'E'};
+
+struct TraceRingHead
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t capacity;
+	std::atomic<uint64_t> next;
+	uint8_t pad[32];
+};
+
+struct TraceRecord
+{
+	uint64_t key;
+	uint8_t cmd;
+	uint8_t flags;
+	uint16_t pad;
+	uint32_t len;
+	uint64_t ts[kTraceStages];
+};
+
+// Per-pkg latency tracing. When disabled pkgs carry no trace and every
+// hook is a single load and branch.
+class Tracer
+{
+public:
+	// sample: dump 1 of this many finished traces to ring_file, 0 for none
+	static bool Enable(const std::string& ring_file, uint64_t sample);
+
+	// first stages (Read, TunnelRecv) attach a trace, later ones only
+	// stamp pkgs that carry one
+	static void Stamp(Pkg* pkg, TraceStage stage) {
+		if (on_.load(std::memory_order_relaxed))
+			DoStamp(pkg, stage);
+	}
+	// last stage reached, fold the trace into the histograms
+	static void Finish(const Pkg& pkg) {
+		if (pkg.trace)
+			DoFinish(pkg);
+	}
+	static std::string StatsString();
+
+private:
+	static void DoStamp(Pkg* pkg, TraceStage stage);
+	static void DoFinish(const Pkg& pkg);
+	static std::atomic<bool> on_;
+};
+
+CFW_NS_END
@@ -0,0 +1,214 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cstring>
+#include <system_error>
+#include <glog/logging.h>
+#include "cfw_clock.h"
+#include "cfw_udp.h"
+
+CFW_NS_BEGIN
+
+// epoll data of the wakeup eventfd, stream keys are never 0
+static const Key kWakeKey = 0;
+// recvmmsg batches per readable association before looking at others
+static const int kMaxRecvBatches = 4;
+
+UdpRelay::UdpRelay(Channel<Pkg>& channel) : channel_(channel)
+{
+	epfd_ = ::epoll_create1(EPOLL_CLOEXEC);
+	evfd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epfd_ < 0 || evfd_ < 0)
+		throw std::system_error(errno, std::system_category());
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u64 = kWakeKey;
+	if (::epoll_ctl(epfd_, EPOLL_CTL_ADD, evfd_, &ev) < 0)
+		throw std::system_error(errno, std::system_category());
+	thread_ = std::thread(&UdpRelay::Run, this);
+}
+
+UdpRelay::~UdpRelay()
+{
+	stop_ = true;
+	uint64_t one = 1;
+	PCHECK(::write(evfd_, &one, sizeof(one)) == sizeof(one));
+	thread_.join();
+	::close(evfd_);
+	::close(epfd_);
+}
+
+void UdpRelay::Push(std::shared_ptr<Pkg> pkg)
+{
+	bool wake;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		wake = pending_.empty();
+		pending_.push_back(std::move(pkg));
+	}
+	if (wake) {
+		uint64_t one = 1;
+		PCHECK(::write(evfd_, &one, sizeof(one)) == sizeof(one));
+	}
+}
+
+void UdpRelay::Run()
+{
+	LOG(INFO) << "udp relay start";
+	time_t last_gc = Clock::Time();
+	epoll_event evs[64];
+	while (!stop_) {
+		int n = ::epoll_wait(epfd_, evs, 64, 1000);
+		if (n < 0 && errno != EINTR) {
+			PLOG(ERROR) << "udp relay epoll_wait";
+			break;
+		}
+		for (int i = 0; i < n; ++i) {
+			Key key = evs[i].data.u64;
+			if (key == kWakeKey) {
+				uint64_t cnt;
+				while (::read(evfd_, &cnt, sizeof(cnt)) > 0) {}
+				ProcPending();
+				continue;
+			}
+			auto it = assocs_.find(key);
+			if (it != assocs_.end())
+				RecvReplies(it->second.get());
+		}
+		time_t now = Clock::Time();
+		if (last_gc + 10 < now) {
+			GarbageCleanup(120);
+			last_gc = now;
+		}
+	}
+	LOG(INFO) << "udp relay exit";
+}
+
+UdpRelay::Assoc* UdpRelay::GetAssoc(Key key)
+{
+	auto it = assocs_.find(key);
+	if (it != assocs_.end())
+		return it->second.get();
+	std::unique_ptr<Assoc> as(new Assoc);
+	as->key = key;
+	as->last_active = Clock::Time();
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u64 = key;
+	// the NAT port is taken by the first sendmmsg
+	if (::epoll_ctl(epfd_, EPOLL_CTL_ADD, as->sk.sock(), &ev) < 0) {
+		PLOG(ERROR) << "key:" << key << " udp assoc epoll_ctl";
+		return nullptr;
+	}
+	LOG(INFO) << "key:" << key << " udp assoc open";
+	return (assocs_[key] = std::move(as)).get();
+}
+
+bool UdpRelay::ParseDest(Assoc* as, const Bytes& data, SockAddrIn* addr, size_t* head_len)
+{
+	uint32_t net_order_ip;
+	uint16_t net_order_port;
+	size_t pos;
+	if (data.size() >= 7 && data[0] == 1) { // ip (v4)
+		std::memcpy(&net_order_ip, &data[1], sizeof(net_order_ip));
+		pos = 5;
+	} else if (data.size() >= 2 && data[0] == 3 && data.size() >= 4u + data[1]) { // url
+		std::string name(reinterpret_cast<const char*>(&data[2]), data[1]);
+		auto it = as->names.find(name);
+		if (it != as->names.end()) {
+			net_order_ip = it->second;
+		} else {
+			// blocks the relay, but datagram apps rarely send names
+			if (!ResolveIp(name.c_str(), &net_order_ip))
+				return false;
+			as->names[name] = net_order_ip;
+		}
+		pos = 2 + data[1];
+	} else {
+		return false;
+	}
+	std::memcpy(&net_order_port, &data[pos], sizeof(net_order_port));
+	*addr = SockAddrIn(ntohl(net_order_ip), ntohs(net_order_port));
+	*head_len = pos + 2;
+	return true;
+}
+
+void UdpRelay::ProcPending()
+{
+	std::vector<std::shared_ptr<Pkg>> pkgs;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		pkgs.swap(pending_);
+	}
+	std::vector<Assoc*> touched;
+	auto flush = [&touched]() {
+		for (Assoc* as : touched) {
+			as->sk.SendBatch(as->out);
+			as->out.clear();
+		}
+		touched.clear();
+	};
+	for (auto& pkg : pkgs) {
+		if (pkg->cmd == Cmd::kClose) {
+			// send what came before the close, touched may point at it
+			flush();
+			if (assocs_.erase(pkg->key))
+				LOG(INFO) << "key:" << pkg->key << " udp assoc closed";
+			continue;
+		}
+		Assoc* as = GetAssoc(pkg->key);
+		if (!as)
+			continue;
+		Datagram d;
+		size_t head_len;
+		if (!ParseDest(as, pkg->data, &d.addr, &head_len)) {
+			LOG(ERROR) << "key:" << pkg->key << " bad udp dest";
+			continue;
+		}
+		d.data.assign(pkg->data, head_len, Bytes::npos);
+		if (as->out.empty())
+			touched.push_back(as);
+		as->out.push_back(std::move(d));
+		as->last_active = Clock::Time();
+	}
+	flush();
+}
+
+void UdpRelay::RecvReplies(Assoc* as)
+{
+	for (int b = 0; b < kMaxRecvBatches; ++b) {
+		int n = as->sk.RecvBatch(&in_, kMaxDatagram, std::chrono::milliseconds(0));
+		if (n <= 0)
+			break;
+		for (auto& d : in_) {
+			// ATYP(1) ip port DATA
+			auto pkg = std::make_shared<Pkg>(as->key, Cmd::kUdp);
+			uint32_t net_order_ip = htonl(d.addr.ip());
+			uint16_t net_order_port = htons(d.addr.port());
+			pkg->data.reserve(7 + d.data.size());
+			pkg->data.push_back(1);
+			pkg->data.append(reinterpret_cast<const uint8_t*>(&net_order_ip), 4);
+			pkg->data.append(reinterpret_cast<const uint8_t*>(&net_order_port), 2);
+			pkg->data.append(d.data);
+			channel_.Push(0, std::move(pkg));
+		}
+		as->last_active = Clock::Time();
+		if (static_cast<size_t>(n) < UdpSocket::kBatch)
+			break;
+	}
+}
+
+void UdpRelay::GarbageCleanup(time_t secs)
+{
+	time_t now = Clock::Time();
+	for (auto it = assocs_.begin(); it != assocs_.end(); ) {
+		if (it->second->last_active + secs < now) {
+			LOG(INFO) << "garbage cleanup udp assoc key:" << it->first;
+			it = assocs_.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+CFW_NS_END
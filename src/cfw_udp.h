@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "socket.h"
+#include "cfw_channel.h"
+
+CFW_NS_BEGIN
+
+// Server side of SOCKS5 UDP ASSOCIATE. Each association (stream key) is
+// NATed through its own UDP socket, so replies map back to the key by
+// the socket they arrive on. One relay thread per tunnel moves the
+// datagrams with recvmmsg/sendmmsg batches, polled with epoll.
+class UdpRelay
+{
+public:
+	// replies are pushed to channel key 0 as kUdp pkgs
+	explicit UdpRelay(Channel<Pkg>& channel);
+	UdpRelay(const UdpRelay&) = delete;
+	UdpRelay& operator=(const UdpRelay&) = delete;
+	~UdpRelay();
+	// queue a kUdp (opening the association if needed) or a kClose
+	// of an association, from any thread
+	void Push(std::shared_ptr<Pkg> pkg);
+
+private:
+	struct Assoc {
+		Key key;
+		UdpSocket sk;
+		time_t last_active = 0;
+		std::vector<Datagram> out;
+		// resolved ATYP 3 names
+		std::map<std::string, uint32_t> names;
+	};
+	void Run();
+	void ProcPending();
+	void RecvReplies(Assoc* as);
+	Assoc* GetAssoc(Key key);
+	bool ParseDest(Assoc* as, const Bytes& data, SockAddrIn* addr, size_t* head_len);
+	void GarbageCleanup(time_t secs);
+
+	Channel<Pkg>& channel_;
+	int epfd_ = -1;
+	int evfd_ = -1;
+	std::atomic<bool> stop_{false};
+	std::mutex mutex_;
+	std::vector<std::shared_ptr<Pkg>> pending_;
+	std::map<Key, std::unique_ptr<Assoc>> assocs_;
+	std::vector<Datagram> in_;
+	std::thread thread_;
+};
+
+CFW_NS_END
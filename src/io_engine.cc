@@ -0,0 +1,519 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <limits.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <glog/logging.h>
+#include "io_engine.h"
+#ifdef HAVE_LINUX_IO_URING_H
+#include "uring.h"
+#endif
+
+CFW_NS_BEGIN
+
+static IoEngine::Stats g_stats;
+static std::atomic<bool> g_use_uring{false};
+// of the last engine created, for stats without creating one
+static std::atomic<const char*> g_engine_name{"none"};
+static thread_local std::unique_ptr<IoEngine> t_engine;
+
+// plain syscalls, one poll(2) when the socket has nothing to read
+class PollEngine : public IoEngine
+{
+public:
+	virtual const char* name() const override {
+		return "poll";
+	}
+	virtual bool SendV(int fd, const iovec* iov, int cnt) override;
+	virtual int SendSome(int fd, const iovec* iov, int cnt) override;
+	virtual int RecvAppend(int fd, Bytes* out, size_t max,
+			std::chrono::milliseconds msecs) override;
+	virtual int Accept(int fd, sockaddr* addr, socklen_t* len) override;
+};
+
+bool PollEngine::SendV(int fd, const iovec* iov, int cnt)
+{
+	std::vector<iovec> vec(iov, iov + cnt);
+	size_t idx = 0;
+	while (idx < vec.size()) {
+		msghdr msg;
+		std::memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &vec[idx];
+		msg.msg_iovlen = std::min<size_t>(vec.size() - idx, IOV_MAX);
+		ssize_t r = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+		++g_stats.syscalls;
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		g_stats.bytes_out += r;
+		size_t left = static_cast<size_t>(r);
+		while (idx < vec.size() && left >= vec[idx].iov_len)
+			left -= vec[idx++].iov_len;
+		if (left) {
+			vec[idx].iov_base = static_cast<uint8_t*>(vec[idx].iov_base) + left;
+			vec[idx].iov_len -= left;
+		}
+	}
+	return true;
+}
+
+int PollEngine::SendSome(int fd, const iovec* iov, int cnt)
+{
+	msghdr msg;
+	std::memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = const_cast<iovec*>(iov);
+	msg.msg_iovlen = std::min(cnt, IOV_MAX);
+	ssize_t r;
+	do {
+		r = ::sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		++g_stats.syscalls;
+	} while (r < 0 && errno == EINTR);
+	if (r > 0)
+		g_stats.bytes_out += r;
+	else if (r < 0 && errno == EWOULDBLOCK)
+		errno = EAGAIN;
+	return static_cast<int>(r);
+}
+
+int PollEngine::RecvAppend(int fd, Bytes* out, size_t max,
+		std::chrono::milliseconds msecs)
+{
+	size_t old_size = out->size();
+	out->resize(old_size + max);
+	// optimistic read first, under load data is mostly there already
+	ssize_t r = ::recv(fd, &(*out)[old_size], max, MSG_DONTWAIT);
+	++g_stats.syscalls;
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		pollfd pfd = {fd, POLLIN, 0};
+		int pr = ::poll(&pfd, 1, static_cast<int>(msecs.count()));
+		++g_stats.syscalls;
+		if (pr == 0) {
+			out->resize(old_size);
+			errno = EAGAIN;
+			return -1;
+		} else if (pr > 0) {
+			r = ::recv(fd, &(*out)[old_size], max, MSG_DONTWAIT);
+			++g_stats.syscalls;
+		} else {
+			r = -1;
+		}
+	}
+	out->resize(old_size + (r > 0 ? r : 0));
+	if (r > 0)
+		g_stats.bytes_in += r;
+	return static_cast<int>(r);
+}
+
+int PollEngine::Accept(int fd, sockaddr* addr, socklen_t* len)
+{
+	++g_stats.syscalls;
+	return ::accept(fd, addr, len);
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+// io_uring: linked send SQEs, provided-buffer recv with a linked
+// timeout, and one multishot accept armed per listening socket
+class UringEngine : public IoEngine
+{
+public:
+	bool Init();
+	virtual const char* name() const override {
+		return "uring";
+	}
+	virtual bool SendV(int fd, const iovec* iov, int cnt) override;
+	virtual int SendSome(int fd, const iovec* iov, int cnt) override;
+	virtual int RecvAppend(int fd, Bytes* out, size_t max,
+			std::chrono::milliseconds msecs) override;
+	virtual int Accept(int fd, sockaddr* addr, socklen_t* len) override;
+	virtual void Forget(int fd) override;
+
+private:
+	enum Op : uint64_t {
+		kSend = 1,
+		kRecv = 2,
+		kAccept = 3,
+		kProvide = 4,
+		kTimeout = 5,
+	};
+	static uint64_t Tag(Op op, uint64_t v) {
+		return (static_cast<uint64_t>(op) << 56) | (v & ((1ULL << 56) - 1));
+	}
+	struct Done {
+		uint64_t tag;
+		int32_t res;
+		uint32_t flags;
+	};
+	struct AcceptState {
+		bool armed = false;
+		bool multishot = true;
+		int error = 0;
+		std::deque<int> ready;
+	};
+	io_uring_sqe* Sqe();
+	void Enter(unsigned wait_nr);
+	void Reap();
+	bool WaitDone(uint64_t tag, Done* done);
+	void ProvideBuffer(int bid, unsigned count);
+
+	static const unsigned kEntries = 64;
+	// RecvAppend waits for its receive, so one buffer is in use at a time
+	// and the rest cover re-provides that failed; when none are left it
+	// falls back to the poll engine
+	static const unsigned kBufCount = 4;
+	static const unsigned kBufSize = 16384;
+	static const uint16_t kBufGroup = 1;
+
+	IoUring ring_;
+	PollEngine fallback_;
+	std::unique_ptr<uint8_t[]> bufs_;
+	bool bufs_provided_ = false;
+	__kernel_timespec ts_;
+	uint64_t seq_ = 0;
+	std::vector<Done> done_;
+	std::map<int, AcceptState> accepts_;
+};
+
+bool UringEngine::Init()
+{
+	return ring_.Init(kEntries);
+}
+
+io_uring_sqe* UringEngine::Sqe()
+{
+	io_uring_sqe* sqe = ring_.GetSqe();
+	if (!sqe) {
+		Enter(0);
+		sqe = ring_.GetSqe();
+		CHECK(sqe) << "io_uring SQ still full after submit";
+	}
+	return sqe;
+}
+
+void UringEngine::Enter(unsigned wait_nr)
+{
+	int r = ring_.Submit(wait_nr);
+	++g_stats.syscalls;
+	PLOG_IF(ERROR, r < 0 && r != -EBUSY && r != -EAGAIN) << "io_uring_enter";
+	Reap();
+}
+
+void UringEngine::Reap()
+{
+	while (io_uring_cqe* cqe = ring_.PeekCqe()) {
+		Done d = {cqe->user_data, cqe->res, cqe->flags};
+		ring_.SeenCqe();
+		uint64_t op = d.tag >> 56;
+		if (op == kAccept) {
+			auto it = accepts_.find(static_cast<int>(d.tag & 0xffffffff));
+			if (it == accepts_.end()) {
+				// listener already forgotten
+				if (d.res >= 0)
+					::close(d.res);
+				continue;
+			}
+			AcceptState& st = it->second;
+			if (d.res >= 0) {
+				st.ready.push_back(d.res);
+			} else if (d.res == -EINVAL && st.multishot && st.ready.empty()) {
+				// kernel older than 5.19, no multishot accept
+				st.multishot = false;
+			} else {
+				st.error = -d.res;
+			}
+			if (!(d.flags & IORING_CQE_F_MORE))
+				st.armed = false;
+		} else if (op == kProvide) {
+			LOG_IF(ERROR, d.res < 0) << "io_uring provide buffers error:" << d.res;
+		} else if (op == kSend || op == kRecv) {
+			done_.push_back(d);
+		}
+		// link timeout completions carry nothing of interest
+	}
+}
+
+bool UringEngine::WaitDone(uint64_t tag, Done* done)
+{
+	while (true) {
+		for (auto it = done_.begin(); it != done_.end(); ++it) {
+			if (it->tag == tag) {
+				*done = *it;
+				done_.erase(it);
+				return true;
+			}
+		}
+		Enter(1);
+	}
+}
+
+void UringEngine::ProvideBuffer(int bid, unsigned count)
+{
+	io_uring_sqe* sqe = Sqe();
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = static_cast<int32_t>(count);
+	sqe->addr = reinterpret_cast<uint64_t>(bufs_.get() + bid * kBufSize);
+	sqe->len = kBufSize;
+	sqe->off = static_cast<uint64_t>(bid);
+	sqe->buf_group = kBufGroup;
+	sqe->user_data = Tag(kProvide, 0);
+}
+
+bool UringEngine::SendV(int fd, const iovec* iov, int cnt)
+{
+	// a single link chain must fit in the SQ, leave room for strays
+	const int kBatch = kEntries / 2;
+	for (int base = 0; base < cnt; base += kBatch) {
+		int n = std::min(kBatch, cnt - base);
+		uint64_t first = seq_;
+		for (int i = 0; i < n; ++i) {
+			io_uring_sqe* sqe = Sqe();
+			sqe->opcode = IORING_OP_SEND;
+			sqe->fd = fd;
+			sqe->addr = reinterpret_cast<uint64_t>(iov[base + i].iov_base);
+			sqe->len = static_cast<uint32_t>(iov[base + i].iov_len);
+			// without MSG_WAITALL a short send does not break the link
+			sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+			sqe->flags = (i + 1 < n ? IOSQE_IO_LINK : 0);
+			sqe->user_data = Tag(kSend, seq_++);
+		}
+		// kernels that don't retry short sends fail the chain, the rest
+		// come back -ECANCELED and are finished with plain send(2) below
+		int broken = -1;
+		size_t sent_in_broken = 0;
+		int error = 0;
+		for (int i = 0; i < n; ++i) {
+			Done d;
+			WaitDone(Tag(kSend, first + i), &d);
+			if (broken >= 0)
+				continue;
+			size_t want = iov[base + i].iov_len;
+			if (d.res >= 0)
+				g_stats.bytes_out += d.res;
+			if (d.res >= 0 && static_cast<size_t>(d.res) == want)
+				continue;
+			broken = i;
+			if (d.res >= 0)
+				sent_in_broken = static_cast<size_t>(d.res);
+			else if (d.res != -ECANCELED)
+				error = -d.res;
+		}
+		if (error) {
+			errno = error;
+			return false;
+		}
+		if (broken < 0)
+			continue;
+		for (int i = broken; i < n; ++i) {
+			const uint8_t* p = static_cast<const uint8_t*>(iov[base + i].iov_base);
+			size_t len = iov[base + i].iov_len;
+			size_t off = (i == broken ? sent_in_broken : 0);
+			while (off < len) {
+				ssize_t r = ::send(fd, p + off, len - off, MSG_NOSIGNAL);
+				++g_stats.syscalls;
+				if (r < 0 && errno == EINTR)
+					continue;
+				if (r <= 0)
+					return false;
+				g_stats.bytes_out += r;
+				off += r;
+			}
+		}
+	}
+	return true;
+}
+
+int UringEngine::SendSome(int fd, const iovec* iov, int cnt)
+{
+	msghdr msg;
+	std::memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = const_cast<iovec*>(iov);
+	msg.msg_iovlen = std::min(cnt, IOV_MAX);
+	uint64_t tag = Tag(kSend, seq_++);
+	io_uring_sqe* sqe = Sqe();
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uint64_t>(&msg);
+	sqe->len = 1;
+	// MSG_DONTWAIT keeps the kernel from parking it on a full socket
+	sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+	sqe->user_data = tag;
+
+	Done d;
+	WaitDone(tag, &d);
+	if (d.res < 0) {
+		errno = (d.res == -EWOULDBLOCK ? EAGAIN : -d.res);
+		return -1;
+	}
+	g_stats.bytes_out += d.res;
+	return d.res;
+}
+
+int UringEngine::RecvAppend(int fd, Bytes* out, size_t max,
+		std::chrono::milliseconds msecs)
+{
+	if (!bufs_provided_) {
+		bufs_.reset(new uint8_t[kBufCount * kBufSize]);
+		ProvideBuffer(0, kBufCount);
+		bufs_provided_ = true;
+	}
+	uint64_t tag = Tag(kRecv, seq_++);
+	io_uring_sqe* sqe = Sqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->len = static_cast<uint32_t>(std::min<size_t>(max, kBufSize));
+	sqe->flags = IOSQE_BUFFER_SELECT | IOSQE_IO_LINK;
+	sqe->buf_group = kBufGroup;
+	sqe->user_data = tag;
+	auto secs = std::chrono::duration_cast<std::chrono::seconds>(msecs);
+	ts_.tv_sec = secs.count();
+	ts_.tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(msecs - secs).count();
+	sqe = Sqe();
+	sqe->opcode = IORING_OP_LINK_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = reinterpret_cast<uint64_t>(&ts_);
+	sqe->len = 1;
+	sqe->user_data = Tag(kTimeout, 0);
+
+	Done d;
+	WaitDone(tag, &d);
+	if (d.flags & IORING_CQE_F_BUFFER) {
+		int bid = static_cast<int>(d.flags >> IORING_CQE_BUFFER_SHIFT);
+		if (d.res > 0)
+			out->append(bufs_.get() + bid * kBufSize, d.res);
+		// hand it back, rides along with the next submission
+		ProvideBuffer(bid, 1);
+	}
+	if (d.res == -ECANCELED) {
+		errno = EAGAIN;
+		return -1;
+	} else if (d.res == -ENOBUFS) {
+		++g_stats.recv_fallbacks;
+		return fallback_.RecvAppend(fd, out, max, msecs);
+	} else if (d.res < 0) {
+		errno = -d.res;
+		return -1;
+	}
+	g_stats.bytes_in += d.res;
+	return d.res;
+}
+
+int UringEngine::Accept(int fd, sockaddr* addr, socklen_t* len)
+{
+	AcceptState& st = accepts_[fd];
+	while (st.ready.empty()) {
+		if (st.error) {
+			errno = st.error;
+			st.error = 0;
+			return -1;
+		}
+		if (!st.armed) {
+			io_uring_sqe* sqe = Sqe();
+			sqe->opcode = IORING_OP_ACCEPT;
+			sqe->fd = fd;
+			sqe->ioprio = (st.multishot ? IORING_ACCEPT_MULTISHOT : 0);
+			sqe->user_data = Tag(kAccept, static_cast<uint32_t>(fd));
+			st.armed = true;
+		}
+		Enter(1);
+	}
+	int sk = st.ready.front();
+	st.ready.pop_front();
+	// multishot completions carry no address, ask for it if wanted
+	if (addr && len && ::getpeername(sk, addr, len) != 0)
+		*len = 0;
+	return sk;
+}
+
+void UringEngine::Forget(int fd)
+{
+	auto it = accepts_.find(fd);
+	if (it == accepts_.end())
+		return;
+	if (it->second.armed) {
+		io_uring_sqe* sqe = Sqe();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = Tag(kAccept, static_cast<uint32_t>(fd));
+		sqe->user_data = Tag(kTimeout, 0);
+		Enter(0);
+	}
+	for (int sk : it->second.ready)
+		::close(sk);
+	accepts_.erase(it);
+}
+
+#endif // HAVE_LINUX_IO_URING_H
+
+void IoEngine::UseUring(bool on)
+{
+	g_use_uring = on;
+}
+
+// a forked child must not share the parent's io_uring, the rings are
+// MAP_SHARED with the kernel and would be driven by both processes
+static void DropEngineInChild()
+{
+	t_engine.reset();
+}
+
+IoEngine& IoEngine::Current()
+{
+	static std::once_flag atfork_once;
+	std::call_once(atfork_once, [] {
+		::pthread_atfork(nullptr, nullptr, DropEngineInChild);
+	});
+	if (!t_engine) {
+#ifdef HAVE_LINUX_IO_URING_H
+		if (g_use_uring && IoUring::Supported()) {
+			std::unique_ptr<UringEngine> e(new UringEngine);
+			if (e->Init())
+				t_engine = std::move(e);
+			else
+				PLOG(ERROR) << "io_uring setup failed, fall back to poll";
+		}
+#endif
+		if (!t_engine)
+			t_engine.reset(new PollEngine);
+		g_engine_name.store(t_engine->name(), std::memory_order_relaxed);
+	}
+	return *t_engine;
+}
+
+void IoEngine::Release(int fd)
+{
+	if (t_engine)
+		t_engine->Forget(fd);
+}
+
+IoEngine::Stats& IoEngine::stats()
+{
+	return g_stats;
+}
+
+std::string IoEngine::StatsString()
+{
+	uint64_t calls = g_stats.syscalls;
+	uint64_t bytes = g_stats.bytes_in + g_stats.bytes_out;
+	char str[192];
+	snprintf(str, sizeof(str),
+			"io engine:%s syscalls:%llu bytes:%llu syscalls/GB:%.0f recv_fallbacks:%llu",
+			g_engine_name.load(std::memory_order_relaxed),
+			static_cast<unsigned long long>(calls),
+			static_cast<unsigned long long>(bytes),
+			bytes ? calls * 1e9 / bytes : 0.0,
+			static_cast<unsigned long long>(g_stats.recv_fallbacks));
+	return str;
+}
+
+CFW_NS_END
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include "cfw.h"
+
+CFW_NS_BEGIN
+
+// IoEngine does the syscall work behind Socket/TcpSocket.
+// Each thread gets its own engine instance (io_uring rings are not
+// thread-safe), all of them report into the same global counters.
+class IoEngine
+{
+public:
+	struct Stats {
+		std::atomic<uint64_t> syscalls{0};
+		std::atomic<uint64_t> bytes_in{0};
+		std::atomic<uint64_t> bytes_out{0};
+		// io_uring receives that found no provided buffer and used recv(2)
+		std::atomic<uint64_t> recv_fallbacks{0};
+	};
+
+	virtual ~IoEngine() = default;
+	virtual const char* name() const = 0;
+	// send every byte of iov[0..cnt) or fail
+	virtual bool SendV(int fd, const iovec* iov, int cnt) = 0;
+	// send what fits without blocking, ret >=0:bytes -1:error (EAGAIN
+	// when the socket buffer is full)
+	virtual int SendSome(int fd, const iovec* iov, int cnt) = 0;
+	// append at most max bytes to *out, waiting at most msecs for data
+	// ret >0:bytes 0:closed by peer -1:error (errno EAGAIN on timeout)
+	virtual int RecvAppend(int fd, Bytes* out, size_t max,
+			std::chrono::milliseconds msecs) = 0;
+	virtual int Accept(int fd, sockaddr* addr, socklen_t* len) = 0;
+	// drop per-fd state before the fd is closed
+	virtual void Forget(int fd) {}
+
+	// select io_uring for engines created afterwards, falls back to
+	// poll(2) if the running kernel lacks the opcodes we need
+	static void UseUring(bool on);
+	static IoEngine& Current();
+	// like Current()->Forget(fd) but never creates an engine
+	static void Release(int fd);
+	static Stats& stats();
+	static std::string StatsString();
+};
+
+CFW_NS_END
@@ -1,9 +1,14 @@
 #include <sys/types.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <algorithm>
+#include <cstring>
 #include <system_error>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include "socket.h"
+#include "io_engine.h"
 
 CFW_NS_BEGIN
 
@@ -35,6 +40,7 @@ Socket::~Socket()
 bool Socket::Close()
 {
 	if (sock() >= 0) {
+		IoEngine::Release(sock());
 		int r = ::close(sock());
 		set_sock(-1);
 		return r == 0;
@@ -65,6 +71,14 @@ bool Socket::Connect(const SockAddr& addr)
 	return r == 0;
 }
 
+int Socket::Poll(short events, std::chrono::milliseconds msecs)
+{
+	pollfd pfd = {sock(), events, 0};
+	int r = ::poll(&pfd, 1, static_cast<int>(msecs.count()));
+	++IoEngine::stats().syscalls;
+	return r > 0 ? pfd.revents : r;
+}
+
 bool Socket::IsNonBlocking()
 {
 	int flags = ::fcntl(sock(), F_GETFL, 0);
@@ -108,17 +122,134 @@ bool Socket::SetReuseAddr(bool on)
 	return SetOpt(SO_REUSEADDR, static_cast<int>(on));
 }
 
-bool TcpSocket::SendN(const uint8_t* buf, size_t n)
+bool Socket::SetReusePort(bool on)
 {
-	int r;
-	for (size_t i = 0; i < n; i += r) {
-		r = Send(buf + i, n - i);
-		if (r <= 0) 
-			return false;
-	}
+	return SetOpt(SO_REUSEPORT, static_cast<int>(on));
+}
+
+bool Socket::SetNoDelay(bool on)
+{
+	return SetSockOpt(IPPROTO_TCP, TCP_NODELAY, static_cast<int>(on));
+}
+
+bool Socket::SetSendBufSize(int bytes)
+{
+	return SetOpt(SO_SNDBUF, bytes);
+}
+
+bool Socket::SetRecvBufSize(int bytes)
+{
+	return SetOpt(SO_RCVBUF, bytes);
+}
+
+bool Socket::SetNotSentLowat(int bytes)
+{
+	return SetSockOpt(IPPROTO_TCP, TCP_NOTSENT_LOWAT, bytes);
+}
+
+bool Socket::SetKeepAlive(int idle_secs, int intvl_secs, int cnt)
+{
+	if (!SetOpt(SO_KEEPALIVE, static_cast<int>(idle_secs >= 0)))
+		return false;
+	if (idle_secs > 0 && !SetSockOpt(IPPROTO_TCP, TCP_KEEPIDLE, idle_secs))
+		return false;
+	if (intvl_secs > 0 && !SetSockOpt(IPPROTO_TCP, TCP_KEEPINTVL, intvl_secs))
+		return false;
+	if (cnt > 0 && !SetSockOpt(IPPROTO_TCP, TCP_KEEPCNT, cnt))
+		return false;
 	return true;
 }
 
+bool Socket::SetBindAddressNoPort(bool on)
+{
+	return SetSockOpt(IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, static_cast<int>(on));
+}
+
+bool Socket::SetFastOpen(int qlen)
+{
+	return SetSockOpt(IPPROTO_TCP, TCP_FASTOPEN, qlen);
+}
+
+bool Socket::SetFastOpenConnect(bool on)
+{
+	return SetSockOpt(IPPROTO_TCP, TCP_FASTOPEN_CONNECT, static_cast<int>(on));
+}
+
+bool SockOpts::Profile(const std::string& name, SockOpts* opts)
+{
+	*opts = SockOpts();
+	if (name == "default") {
+		return true;
+	} else if (name == "latency") {
+		opts->nodelay = 1;
+		opts->notsent_lowat = 16 * 1024;
+		opts->fastopen = 16;
+		opts->keepalive_idle = 60;
+		opts->keepalive_intvl = 10;
+		opts->keepalive_cnt = 6;
+		return true;
+	} else if (name == "throughput") {
+		// frames are batched by the writer, Nagle would only add delay
+		opts->nodelay = 1;
+		opts->sndbuf = 4 * 1024 * 1024;
+		opts->rcvbuf = 4 * 1024 * 1024;
+		opts->fastopen = 16;
+		opts->keepalive_idle = 60;
+		opts->keepalive_intvl = 10;
+		opts->keepalive_cnt = 6;
+		return true;
+	}
+	return false;
+}
+
+// the options every socket role shares
+static bool SetCommonOpts(Socket* sk, const SockOpts& o)
+{
+	bool ok = true;
+	if (o.nodelay >= 0)
+		ok = sk->SetNoDelay(o.nodelay) && ok;
+	if (o.sndbuf > 0)
+		ok = sk->SetSendBufSize(o.sndbuf) && ok;
+	if (o.rcvbuf > 0)
+		ok = sk->SetRecvBufSize(o.rcvbuf) && ok;
+	if (o.notsent_lowat > 0)
+		ok = sk->SetNotSentLowat(o.notsent_lowat) && ok;
+	if (o.keepalive_idle >= 0)
+		ok = sk->SetKeepAlive(o.keepalive_idle, o.keepalive_intvl, o.keepalive_cnt) && ok;
+	if (o.bind_no_port >= 0)
+		ok = sk->SetBindAddressNoPort(o.bind_no_port) && ok;
+	return ok;
+}
+
+bool TcpSocket::SetOpts(const SockOpts& opts)
+{
+	bool ok = SetCommonOpts(this, opts);
+	if (opts.fastopen > 0)
+		ok = SetFastOpenConnect() && ok;
+	return ok;
+}
+
+bool TcpSocket::SendN(const uint8_t* buf, size_t n)
+{
+	iovec iov = {const_cast<uint8_t*>(buf), n};
+	return SendV(&iov, 1);
+}
+
+bool TcpSocket::SendV(const iovec* iov, int cnt)
+{
+	return IoEngine::Current().SendV(sock(), iov, cnt);
+}
+
+int TcpSocket::RecvSome(Bytes* out, size_t max, std::chrono::milliseconds msecs)
+{
+	return IoEngine::Current().RecvAppend(sock(), out, max, msecs);
+}
+
+int TcpSocket::SendSome(const iovec* iov, int cnt)
+{
+	return IoEngine::Current().SendSome(sock(), iov, cnt);
+}
+
 bool TcpSocket::RecvN(uint8_t* buf, size_t n)
 {
 	int r;
@@ -131,14 +262,210 @@ bool TcpSocket::RecvN(uint8_t* buf, size_t n)
 }
 
 
+namespace {
+
+// one way of TcpSocket::Splice: src -> pipe -> dst
+struct SpliceWay
+{
+	int src;
+	int dst;
+	int pipe[2] = {-1, -1};
+	size_t queued = 0;	// bytes in the pipe
+	bool eof = false;
+	bool done = false;
+
+	~SpliceWay() {
+		if (pipe[0] >= 0) {
+			::close(pipe[0]);
+			::close(pipe[1]);
+		}
+	}
+	// move what can move without blocking, ret false on error
+	bool Pump(short* src_events, short* dst_events) {
+		const size_t kPipeLen = 65536;
+		*src_events = *dst_events = 0;
+		while (!done) {
+			bool moved = false;
+			if (!eof && queued < kPipeLen) {
+				ssize_t r = ::splice(src, nullptr, pipe[1], nullptr, kPipeLen - queued,
+						SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				++IoEngine::stats().syscalls;
+				if (r > 0) {
+					queued += r;
+					IoEngine::stats().bytes_in += r;
+					moved = true;
+				} else if (r == 0) {
+					eof = true;
+				} else if (errno != EAGAIN) {
+					return false;
+				}
+			}
+			if (queued > 0) {
+				ssize_t r = ::splice(pipe[0], nullptr, dst, nullptr, queued,
+						SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				++IoEngine::stats().syscalls;
+				if (r > 0) {
+					queued -= r;
+					IoEngine::stats().bytes_out += r;
+					moved = true;
+				} else if (r < 0 && errno != EAGAIN) {
+					return false;
+				}
+			}
+			if (eof && queued == 0) {
+				::shutdown(dst, SHUT_WR);
+				done = true;
+			} else if (!moved) {
+				break;
+			}
+		}
+		if (!done) {
+			if (!eof && queued < kPipeLen)
+				*src_events = POLLIN;
+			if (queued > 0)
+				*dst_events = POLLOUT;
+		}
+		return true;
+	}
+};
+
+} // namespace
+
+bool TcpSocket::Splice(TcpSocket& a, TcpSocket& b, std::chrono::seconds idle)
+{
+	SpliceWay ways[2];
+	ways[0].src = ways[1].dst = a.sock();
+	ways[0].dst = ways[1].src = b.sock();
+	for (auto& way : ways) {
+		if (::pipe2(way.pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+			return false;
+	}
+	if (!a.SetNonBlocking() || !b.SetNonBlocking())
+		return false;
+	while (!ways[0].done || !ways[1].done) {
+		short a_events = 0, b_events = 0;
+		for (int i = 0; i < 2; ++i) {
+			short src_events, dst_events;
+			if (!ways[i].Pump(&src_events, &dst_events))
+				return false;
+			(i == 0 ? a_events : b_events) |= src_events;
+			(i == 0 ? b_events : a_events) |= dst_events;
+		}
+		if (ways[0].done && ways[1].done)
+			break;
+		// a socket with nothing to wait for is left out, its POLLHUP
+		// would wake us up for nothing
+		pollfd pfds[2] = {{a_events ? a.sock() : -1, a_events, 0},
+			{b_events ? b.sock() : -1, b_events, 0}};
+		int r = ::poll(pfds, 2, static_cast<int>(idle.count() * 1000));
+		if (r == 0) {
+			errno = ETIMEDOUT;
+			return false;
+		}
+		if (r < 0 && errno != EINTR)
+			return false;
+	}
+	return true;
+}
+
+int UdpSocket::RecvBatch(std::vector<Datagram>* out, size_t max_len,
+		std::chrono::milliseconds msecs)
+{
+	pollfd pfd = {sock(), POLLIN, 0};
+	int r = ::poll(&pfd, 1, static_cast<int>(msecs.count()));
+	if (r <= 0) {
+		if (r == 0)
+			errno = EAGAIN;
+		return -1;
+	}
+	mmsghdr msgs[kBatch];
+	iovec iov[kBatch];
+	sockaddr_in addrs[kBatch];
+	out->resize(kBatch);
+	for (size_t i = 0; i < kBatch; ++i) {
+		Bytes& data = (*out)[i].data;
+		data.resize(max_len);
+		iov[i] = {&data[0], max_len};
+		std::memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	int n = ::recvmmsg(sock(), msgs, kBatch, MSG_DONTWAIT, nullptr);
+	++IoEngine::stats().syscalls;
+	if (n < 0)
+		return -1;
+	int count = 0;
+	for (int i = 0; i < n; ++i) {
+		if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+			continue;
+		Datagram& d = (*out)[count++];
+		if (count - 1 != i)
+			d.data.swap((*out)[i].data);
+		d.addr = SockAddrIn(addrs[i]);
+		d.data.resize(msgs[i].msg_len);
+		IoEngine::stats().bytes_in += msgs[i].msg_len;
+	}
+	out->resize(count);
+	return count;
+}
+
+int UdpSocket::SendBatch(const std::vector<Datagram>& dgrams)
+{
+	mmsghdr msgs[kBatch];
+	iovec iov[kBatch];
+	size_t sent = 0, dropped = 0;
+	while (sent < dgrams.size()) {
+		size_t n = std::min(dgrams.size() - sent, kBatch);
+		for (size_t i = 0; i < n; ++i) {
+			const Datagram& d = dgrams[sent + i];
+			iov[i] = {const_cast<uint8_t*>(d.data.data()), d.data.size()};
+			std::memset(&msgs[i], 0, sizeof(msgs[i]));
+			msgs[i].msg_hdr.msg_name = d.addr.ptr();
+			msgs[i].msg_hdr.msg_namelen = d.addr.len();
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		int r = ::sendmmsg(sock(), msgs, n, MSG_DONTWAIT);
+		++IoEngine::stats().syscalls;
+		if (r <= 0) {
+			// a full socket buffer drops the rest like the network would,
+			// other errors only drop the datagram that failed
+			if (errno == EAGAIN)
+				break;
+			++dropped;
+			++sent;
+			continue;
+		}
+		for (int i = 0; i < r; ++i)
+			IoEngine::stats().bytes_out += msgs[i].msg_len;
+		sent += r;
+	}
+	return static_cast<int>(sent - dropped);
+}
+
 TcpServerSocket::TcpServerSocket()
 {
 	SetReuseAddr();
 }
 
-TcpServerSocket::TcpServerSocket(const SockAddr& bind)
+TcpServerSocket::TcpServerSocket(const SockAddr& bind, bool reuse_port)
 	: TcpServerSocket()
 {
+	if (reuse_port && !SetReusePort()) {
+		throw std::system_error(errno, std::system_category());
+	}
+	if (!Bind(bind)) {
+		throw std::system_error(errno, std::system_category());
+	}
+}
+
+UnixServerSocket::UnixServerSocket(const SockAddrUn& bind)
+	: TcpServerSocket(AF_UNIX, SOCK_STREAM)
+{
+	if (!bind.abstract())
+		::unlink(bind.path().c_str());
 	if (!Bind(bind)) {
 		throw std::system_error(errno, std::system_category());
 	}
@@ -150,6 +477,14 @@ bool TcpServerSocket::Listen(int backlog)
 	return r == 0;
 }
 
+bool TcpServerSocket::SetOpts(const SockOpts& opts)
+{
+	bool ok = SetCommonOpts(this, opts);
+	if (opts.fastopen > 0)
+		ok = SetFastOpen(opts.fastopen) && ok;
+	return ok;
+}
+
 TcpSocket TcpServerSocket::Accept(SockAddr* addr)
 {
 	sockaddr* saddr = nullptr;
@@ -158,10 +493,81 @@ TcpSocket TcpServerSocket::Accept(SockAddr* addr)
 		saddr = addr->ptr();
 		salen = addr->len();
 	}
-	int sk = ::accept(sock(), saddr, &salen);
+	int sk = IoEngine::Current().Accept(sock(), saddr, &salen);
 	if (sk < 0)
 		return TcpSocket(-1);
 	return TcpSocket(sk);
 }
 
+TcpSocket TcpServerSocket::TryAccept(std::chrono::milliseconds msecs)
+{
+	pollfd pfd = {sock(), POLLIN, 0};
+	int r = ::poll(&pfd, 1, static_cast<int>(msecs.count()));
+	if (r <= 0) {
+		if (r == 0)
+			errno = EAGAIN;
+		return TcpSocket(-1);
+	}
+	++IoEngine::stats().syscalls;
+	return TcpSocket(::accept4(sock(), nullptr, nullptr, SOCK_CLOEXEC));
+}
+
+bool UnixSocket::SendFds(const std::vector<int>& fds)
+{
+	if (fds.empty() || fds.size() > kMaxFds) {
+		errno = EINVAL;
+		return false;
+	}
+	uint8_t count = static_cast<uint8_t>(fds.size());
+	iovec iov = {&count, sizeof(count)};
+	alignas(cmsghdr) char ctrl[CMSG_SPACE(sizeof(int) * kMaxFds)];
+	msghdr msg;
+	std::memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+	cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+	std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+	return ::sendmsg(sock(), &msg, MSG_NOSIGNAL) == sizeof(count);
+}
+
+bool UnixSocket::RecvFds(std::vector<int>* fds)
+{
+	uint8_t count;
+	iovec iov = {&count, sizeof(count)};
+	alignas(cmsghdr) char ctrl[CMSG_SPACE(sizeof(int) * kMaxFds)];
+	msghdr msg;
+	std::memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+	msg.msg_controllen = sizeof(ctrl);
+	if (::recvmsg(sock(), &msg, MSG_CMSG_CLOEXEC) != sizeof(count))
+		return false;
+	fds->clear();
+	for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		const uint8_t* data = CMSG_DATA(cmsg);
+		for (size_t i = 0; i < n; ++i) {
+			int fd;
+			std::memcpy(&fd, data + i * sizeof(int), sizeof(fd));
+			fds->push_back(fd);
+		}
+	}
+	if (fds->size() != count || (msg.msg_flags & MSG_CTRUNC)) {
+		for (int fd : *fds)
+			::close(fd);
+		fds->clear();
+		errno = EPROTO;
+		return false;
+	}
+	return true;
+}
+
 CFW_NS_END
@@ -3,7 +3,12 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <string.h>
 #include <string>
+#include <vector>
 #include <chrono>
 #include "cfw.h"
 
@@ -67,6 +72,65 @@ private:
 
 // class SockAddrIn6 ...
 
+// AF_UNIX address, a leading '@' names a socket in the abstract namespace
+class SockAddrUn : public SockAddr
+{
+public:
+	SockAddrUn() {
+		sa_.sun_family = AF_UNIX;
+	}
+	SockAddrUn(const std::string& path) : SockAddrUn() {
+		size_t n = path.size() < sizeof(sa_.sun_path) - 1 ? path.size() : sizeof(sa_.sun_path) - 1;
+		memcpy(sa_.sun_path, path.data(), n);
+		len_ = offsetof(sockaddr_un, sun_path) + n;
+		if (abstract())
+			sa_.sun_path[0] = 0;
+		else
+			++len_; // count the trailing NUL
+	}
+	virtual sockaddr* ptr() const override {
+		return (sockaddr*)&sa_;
+	}
+	virtual socklen_t len() const override {
+		return len_;
+	}
+	virtual std::string to_str() const override {
+		return "unix:" + path();
+	}
+	bool abstract() const {
+		return len_ > offsetof(sockaddr_un, sun_path) &&
+			(sa_.sun_path[0] == 0 || sa_.sun_path[0] == '@');
+	}
+	std::string path() const {
+		size_t n = len_ - offsetof(sockaddr_un, sun_path);
+		if (abstract())
+			return "@" + std::string(sa_.sun_path + 1, n - 1);
+		return std::string(sa_.sun_path, strnlen(sa_.sun_path, n));
+	}
+private:
+	sockaddr_un sa_ = sockaddr_un();
+	socklen_t len_ = sizeof(sockaddr_un);
+};
+
+// Typed socket tuning, fields left at -1 keep the kernel default.
+// fastopen means TCP_FASTOPEN queue length on listeners and
+// TCP_FASTOPEN_CONNECT (data rides on the SYN) on connecting sockets.
+struct SockOpts
+{
+	int nodelay = -1;
+	int sndbuf = -1;
+	int rcvbuf = -1;
+	int notsent_lowat = -1;
+	int fastopen = -1;
+	int keepalive_idle = -1;	// secs, also turns SO_KEEPALIVE on
+	int keepalive_intvl = -1;
+	int keepalive_cnt = -1;
+	int bind_no_port = -1;
+
+	// named profiles: "default", "latency", "throughput"
+	static bool Profile(const std::string& name, SockOpts* opts);
+};
+
 class Socket
 {
 public:
@@ -97,6 +161,9 @@ public:
 		return RecvFrom(reinterpret_cast<uint8_t*>(buf), len, addr, flags);
 	}
 
+	// wait at most msecs for events (POLLIN...), ret the revents, 0 on
+	// timeout, -1 on error
+	int Poll(short events, std::chrono::milliseconds msecs);
 	bool IsNonBlocking();
 	bool SetNonBlocking(bool nb = true);
 	bool GetPeerAddr(SockAddr* addr);
@@ -111,6 +178,15 @@ public:
 	template <class R, class P> bool SetSendTimeout(std::chrono::duration<R,P> dur);
 	bool IsReuseAddr();
 	bool SetReuseAddr(bool on = true);
+	bool SetReusePort(bool on = true);
+	bool SetNoDelay(bool on = true);
+	bool SetSendBufSize(int bytes);
+	bool SetRecvBufSize(int bytes);
+	bool SetNotSentLowat(int bytes);
+	bool SetKeepAlive(int idle_secs, int intvl_secs = -1, int cnt = -1);
+	bool SetBindAddressNoPort(bool on = true);
+	bool SetFastOpen(int qlen);
+	bool SetFastOpenConnect(bool on = true);
 
 	operator bool() const {
 		return sock() >= 0;
@@ -203,7 +279,7 @@ bool Socket::SetSendTimeout(std::chrono::duration<R,P> dur)
 }
 
 
-class TcpSocket : public Socket
+class TcpSocket : public Socket, public Transport
 {
 public:
 	TcpSocket() : Socket(AF_INET, SOCK_STREAM, 0) {}
@@ -216,9 +292,26 @@ public:
 	bool RecvN(char* buf, size_t n) {
 		return RecvN(reinterpret_cast<uint8_t*>(buf), n);
 	}
+	// send all buffers in one batch through the io engine
+	bool SendV(const iovec* iov, int cnt);
+	int RecvSome(Bytes* out, size_t max, std::chrono::milliseconds msecs) override;
+	int SendSome(const iovec* iov, int cnt) override;
+	int Poll(short events, std::chrono::milliseconds msecs) override {
+		return Socket::Poll(events, msecs);
+	}
+	// apply every option set in opts, ret false if any of them failed
+	bool SetOpts(const SockOpts& opts);
 	template <class T> bool SendValue(const T& ptr);
 	template <class T> bool SendValue(const std::basic_string<T>& ptr);
 	template <class T> bool RecvValue(T* ptr);
+	// relay both ways between a and b with splice() through pipes, so
+	// the data never enters userspace; EOF on one side is passed on as
+	// shutdown(SHUT_WR). Both are made non-blocking.
+	// ret true once both ways are done, false on error or idle timeout
+	static bool Splice(TcpSocket& a, TcpSocket& b, std::chrono::seconds idle);
+protected:
+	// stream sockets of other families, see UnixSocket
+	TcpSocket(int domain, int type, int proto) : Socket(domain, type, proto) {}
 };
 
 template <class T>
@@ -245,9 +338,72 @@ class TcpServerSocket : public TcpSocket
 {
 public:
 	TcpServerSocket();
-	TcpServerSocket(const SockAddr& bind);
+	// reuse_port lets several listeners share the port (SO_REUSEPORT)
+	TcpServerSocket(const SockAddr& bind, bool reuse_port = false);
 	bool Listen(int backlog = 16);
+	// options are inherited by accepted sockets, fastopen is the queue len
+	bool SetOpts(const SockOpts& opts);
 	TcpSocket Accept(SockAddr* addr = nullptr);
+	// wait at most msecs with a plain accept() outside the io engine, so
+	// the caller can look at other state in between; the listener must
+	// be non-blocking when other processes share it.
+	// ret a closed socket, errno EAGAIN on timeout
+	TcpSocket TryAccept(std::chrono::milliseconds msecs);
+	// take over a listening socket, e.g. one passed by another process
+	explicit TcpServerSocket(int sock) : TcpSocket(sock) {}
+	// for passing the listener to another process
+	using Socket::sock;
+protected:
+	TcpServerSocket(int domain, int type) : TcpSocket(domain, type, 0) {}
+};
+
+// UNIX stream sockets go through the same code paths as TCP ones,
+// they just skip the loopback TCP stack when both ends share a host
+class UnixSocket : public TcpSocket
+{
+public:
+	UnixSocket() : TcpSocket(AF_UNIX, SOCK_STREAM, 0) {}
+	UnixSocket(int sock) : TcpSocket(sock) {}
+	// one accepted from a UnixServerSocket
+	explicit UnixSocket(TcpSocket&& sk) : TcpSocket(std::move(sk)) {}
+	// pass fds to the peer (SCM_RIGHTS) along with one byte
+	bool SendFds(const std::vector<int>& fds);
+	// ret false on error or if no fds came along
+	bool RecvFds(std::vector<int>* fds);
+
+	static const size_t kMaxFds = 64;
+};
+
+class UnixServerSocket : public TcpServerSocket
+{
+public:
+	// a stale socket file left by a previous run is removed first
+	UnixServerSocket(const SockAddrUn& bind);
+};
+
+struct Datagram
+{
+	SockAddrIn addr;
+	Bytes data;
+};
+
+class UdpSocket : public Socket
+{
+public:
+	UdpSocket() : Socket(AF_INET, SOCK_DGRAM, 0) {}
+	UdpSocket(int sock) : Socket(sock) {}
+	// receive up to kBatch datagrams of at most max_len bytes with one
+	// recvmmsg, waiting at most msecs for the first; truncated ones are
+	// dropped. Reusing *out across calls reuses its buffers.
+	// ret count, -1 on error (errno EAGAIN on timeout)
+	int RecvBatch(std::vector<Datagram>* out, size_t max_len,
+			std::chrono::milliseconds msecs);
+	// send dgrams with as few sendmmsg as possible, ret count sent
+	int SendBatch(const std::vector<Datagram>& dgrams);
+	// for polling many of them with epoll
+	using Socket::sock;
+
+	static constexpr size_t kBatch = 32;
 };
 
 CFW_NS_END
@@ -0,0 +1,176 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include "uring.h"
+
+CFW_NS_BEGIN
+
+static int SysSetup(unsigned entries, io_uring_params* p)
+{
+	return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int SysEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit,
+				min_complete, flags, nullptr, 0));
+}
+
+static int SysRegister(int fd, unsigned op, void* arg, unsigned nr_args)
+{
+	return static_cast<int>(::syscall(__NR_io_uring_register, fd, op, arg, nr_args));
+}
+
+IoUring::~IoUring()
+{
+	if (sqes_)
+		::munmap(sqes_, sqes_size_);
+	if (cq_ptr_ && cq_ptr_ != sq_ptr_)
+		::munmap(cq_ptr_, cq_size_);
+	if (sq_ptr_)
+		::munmap(sq_ptr_, sq_size_);
+	if (fd_ >= 0)
+		::close(fd_);
+}
+
+bool IoUring::Init(unsigned entries)
+{
+	io_uring_params p;
+	std::memset(&p, 0, sizeof(p));
+	int fd = SysSetup(entries, &p);
+	if (fd < 0)
+		return false;
+	fd_ = fd;
+
+	sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP);
+	if (single_mmap) {
+		if (cq_size_ > sq_size_)
+			sq_size_ = cq_size_;
+		cq_size_ = sq_size_;
+	}
+	sq_ptr_ = ::mmap(nullptr, sq_size_, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+	if (sq_ptr_ == MAP_FAILED) {
+		sq_ptr_ = nullptr;
+		return false;
+	}
+	if (single_mmap) {
+		cq_ptr_ = sq_ptr_;
+	} else {
+		cq_ptr_ = ::mmap(nullptr, cq_size_, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+		if (cq_ptr_ == MAP_FAILED) {
+			cq_ptr_ = nullptr;
+			return false;
+		}
+	}
+	sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+	void* sqes = ::mmap(nullptr, sqes_size_, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, fd_, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		return false;
+	sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+	uint8_t* sq = static_cast<uint8_t*>(sq_ptr_);
+	uint8_t* cq = static_cast<uint8_t*>(cq_ptr_);
+	sq_entries_ = p.sq_entries;
+	sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+	sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+	sq_mask_ = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+	sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+	cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+	cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+	cq_mask_ = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+	cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+	sqe_tail_ = *sq_tail_;
+	return true;
+}
+
+unsigned IoUring::SqSpace() const
+{
+	unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+	return sq_entries_ - (sqe_tail_ - head);
+}
+
+io_uring_sqe* IoUring::GetSqe()
+{
+	if (SqSpace() == 0)
+		return nullptr;
+	unsigned idx = sqe_tail_ & *sq_mask_;
+	sq_array_[idx] = idx;
+	++sqe_tail_;
+	io_uring_sqe* sqe = &sqes_[idx];
+	std::memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int IoUring::Submit(unsigned wait_nr)
+{
+	unsigned to_submit = sqe_tail_ - *sq_tail_;
+	__atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+	if (to_submit == 0 && wait_nr == 0)
+		return 0;
+	unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+	int r;
+	do {
+		r = SysEnter(fd_, to_submit, wait_nr, flags);
+	} while (r < 0 && errno == EINTR);
+	return r < 0 ? -errno : r;
+}
+
+io_uring_cqe* IoUring::PeekCqe()
+{
+	unsigned head = *cq_head_;
+	if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+		return nullptr;
+	return &cqes_[head & *cq_mask_];
+}
+
+void IoUring::SeenCqe()
+{
+	__atomic_store_n(cq_head_, *cq_head_ + 1, __ATOMIC_RELEASE);
+}
+
+static bool ProbeOps()
+{
+	io_uring_params p;
+	std::memset(&p, 0, sizeof(p));
+	int fd = SysSetup(4, &p);
+	if (fd < 0)
+		return false;
+	const size_t nops = 64;
+	std::string mem(sizeof(io_uring_probe) + nops * sizeof(io_uring_probe_op), 0);
+	io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(&mem[0]);
+	int r = SysRegister(fd, IORING_REGISTER_PROBE, probe, nops);
+	::close(fd);
+	if (r < 0)
+		return false;
+	const int needed[] = {
+		IORING_OP_SEND,
+		IORING_OP_SENDMSG,
+		IORING_OP_RECV,
+		IORING_OP_ACCEPT,
+		IORING_OP_PROVIDE_BUFFERS,
+		IORING_OP_LINK_TIMEOUT,
+	};
+	for (int op : needed) {
+		if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+			return false;
+	}
+	return true;
+}
+
+bool IoUring::Supported()
+{
+	static std::once_flag once;
+	static bool supported = false;
+	std::call_once(once, [] { supported = ProbeOps(); });
+	return supported;
+}
+
+CFW_NS_END
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include "cfw.h"
+
+CFW_NS_BEGIN
+
+// Minimal io_uring wrapper on top of the raw syscalls, only what the
+// io engine needs: one SQ/CQ pair, no SQPOLL, no registered files.
+// Not thread-safe, every thread owns its own ring.
+class IoUring
+{
+public:
+	IoUring() = default;
+	IoUring(const IoUring&) = delete;
+	IoUring& operator=(const IoUring&) = delete;
+	~IoUring();
+
+	bool Init(unsigned entries);
+	// ret nullptr if SQ is full, call Submit() first
+	io_uring_sqe* GetSqe();
+	// submit queued SQEs and wait for at least wait_nr CQEs
+	// ret number of SQEs submitted, -errno on error
+	int Submit(unsigned wait_nr = 0);
+	// ret nullptr if CQ is empty
+	io_uring_cqe* PeekCqe();
+	void SeenCqe();
+	unsigned SqSpace() const;
+
+	operator bool() const {
+		return fd_ >= 0;
+	}
+
+	// probe once whether the kernel has every opcode we use
+	static bool Supported();
+
+private:
+	int fd_ = -1;
+	unsigned sq_entries_ = 0;
+	unsigned sqe_tail_ = 0;
+	unsigned* sq_head_ = nullptr;
+	unsigned* sq_tail_ = nullptr;
+	unsigned* sq_mask_ = nullptr;
+	unsigned* sq_array_ = nullptr;
+	io_uring_sqe* sqes_ = nullptr;
+	unsigned* cq_head_ = nullptr;
+	unsigned* cq_tail_ = nullptr;
+	unsigned* cq_mask_ = nullptr;
+	io_uring_cqe* cqes_ = nullptr;
+	void* sq_ptr_ = nullptr;
+	size_t sq_size_ = 0;
+	void* cq_ptr_ = nullptr;
+	size_t cq_size_ = 0;
+	size_t sqes_size_ = 0;
+};
+
+CFW_NS_END